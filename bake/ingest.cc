@@ -0,0 +1,364 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <bake-client.hpp>
+#include <bake-server.hpp>
+
+#include <yokan/cxx/server.hpp>
+#include <yokan/cxx/admin.hpp>
+#include <yokan/cxx/client.hpp>
+
+#include <arrow/io/file.h>
+
+#include "catalog.h"
+#include "stats_index.h"
+
+static char* read_input_file(const char* path);
+
+namespace bk = bake;
+namespace yk = yokan;
+
+// one file to ingest and the yokan key its region is stored under
+struct IngestFile {
+    std::string source;
+    std::string key;
+    uint64_t size;
+};
+
+struct IngestOptions {
+    std::vector<IngestFile> files;
+    // bytes read from a file and written to its region at a time
+    uint64_t chunk_size = 4 << 20;
+    int files_in_flight = 4;
+    // path->region entries per yokan putMulti
+    size_t put_batch = 64;
+    // the same target as bake_config.json, with bake's pipelined writes on
+    std::string bake_config = "bake_ingest_config.json";
+    std::string yokan_config = "yokan_config.json";
+    std::string address = "verbs://ibp130s0";
+};
+
+static void add_file(std::vector<IngestFile> &files, const std::string &source, const std::string &key) {
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        std::cerr << "Skipping " << source << ": not a regular file\n";
+        return;
+    }
+    files.push_back({source, key.empty() ? source : key, (uint64_t)st.st_size});
+}
+
+// A file, every regular file of a directory (sorted), or @list with one
+// "source [key]" pair per line. Keys default to the source path.
+static void add_input(std::vector<IngestFile> &files, const std::string &input) {
+    if (input[0] == '@') {
+        std::ifstream list(input.substr(1));
+        std::string line;
+        while (std::getline(list, line)) {
+            std::istringstream fields(line);
+            std::string source, key;
+            if (fields >> source) {
+                fields >> key;
+                add_file(files, source, key);
+            }
+        }
+        return;
+    }
+    DIR *dir = opendir(input.c_str());
+    if (dir == NULL) {
+        add_file(files, input, "");
+        return;
+    }
+    std::vector<std::string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (const auto &name : names) {
+        add_file(files, input + "/" + name, "");
+    }
+}
+
+static IngestOptions parse_options(int argc, char *argv[]) {
+    IngestOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--chunk-size") {
+            options.chunk_size = std::stoull(value);
+        } else if (name == "--files-in-flight") {
+            options.files_in_flight = std::max(1, std::stoi(value));
+        } else if (name == "--put-batch") {
+            options.put_batch = std::max<size_t>(1, std::stoull(value));
+        } else if (name == "--bake-config") {
+            options.bake_config = value;
+        } else if (name == "--yokan-config") {
+            options.yokan_config = value;
+        } else if (name == "--address") {
+            options.address = value;
+        } else {
+            add_input(options.files, arg);
+        }
+    }
+    return options;
+}
+
+// Closes its file descriptor when it goes out of scope.
+struct ScopedFd {
+    int fd;
+
+    explicit ScopedFd(int fd) : fd(fd) {}
+    ~ScopedFd() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+};
+
+// State shared by the ingest ULTs.
+struct Ingest {
+    const IngestOptions &options;
+    bk::client &bcl;
+    bk::provider_handle &bph;
+    bk::target &tid;
+    yk::Database &db;
+
+    std::atomic<size_t> next_file{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<bool> failed{false};
+
+    // path->region entries waiting for the next putMulti
+    std::mutex puts_mutex;
+    std::vector<std::string> keys;
+    std::vector<std::string> values;
+
+    Ingest(const IngestOptions &options, bk::client &bcl, bk::provider_handle &bph,
+           bk::target &tid, yk::Database &db)
+        : options(options), bcl(bcl), bph(bph), tid(tid), db(db) {}
+
+    void put_multi(const std::vector<std::string> &k, const std::vector<std::string> &v) {
+        if (k.empty()) {
+            return;
+        }
+        std::vector<const void*> key_ptrs, value_ptrs;
+        std::vector<size_t> key_sizes, value_sizes;
+        for (size_t i = 0; i < k.size(); i++) {
+            key_ptrs.push_back(k[i].data());
+            key_sizes.push_back(k[i].size());
+            value_ptrs.push_back(v[i].data());
+            value_sizes.push_back(v[i].size());
+        }
+        db.putMulti(k.size(), key_ptrs.data(), key_sizes.data(), value_ptrs.data(), value_sizes.data());
+    }
+
+    void add_put(const std::string &key, const std::string &value) {
+        std::vector<std::string> k, v;
+        {
+            std::lock_guard<std::mutex> lock(puts_mutex);
+            keys.push_back(key);
+            values.push_back(value);
+            if (keys.size() < options.put_batch) {
+                return;
+            }
+            k.swap(keys);
+            v.swap(values);
+        }
+        put_multi(k, v);
+    }
+
+    void flush_puts() {
+        std::lock_guard<std::mutex> lock(puts_mutex);
+        put_multi(keys, values);
+        keys.clear();
+        values.clear();
+    }
+
+    // the file's min/max statistics, serialized; empty if it has none we can read
+    static std::string file_stats(const IngestFile &file) {
+        auto input = arrow::io::ReadableFile::Open(file.source);
+        arrow::Result<std::string> stats =
+            input.ok() ? ReadFileStats(*input) : arrow::Result<std::string>(input.status());
+        if (!stats.ok()) {
+            std::cerr << "No statistics for " << file.source << ": " << stats.status().ToString() << std::endl;
+            return "";
+        }
+        return *stats;
+    }
+
+    // Streams one file into a new region chunk by chunk, so a file in
+    // flight holds one chunk of memory, then persists the region once. A
+    // region that fails to fill is removed again.
+    void ingest_file(const IngestFile &file, std::vector<char> &chunk) {
+        ScopedFd fd(open(file.source.c_str(), O_RDONLY));
+        if (fd.fd < 0) {
+            throw std::runtime_error("Could not open " + file.source);
+        }
+        bk::region rid = bcl.create(bph, tid, file.size);
+        try {
+            uint64_t offset = 0;
+            while (offset < file.size) {
+                ssize_t n = pread(fd.fd, chunk.data(), std::min<uint64_t>(chunk.size(), file.size - offset), offset);
+                if (n <= 0) {
+                    throw std::runtime_error("Short read from " + file.source);
+                }
+                bcl.write(bph, tid, rid, offset, chunk.data(), n);
+                offset += n;
+            }
+            bcl.persist(bph, tid, rid, 0, file.size);
+        } catch (...) {
+            try {
+                bcl.remove(bph, tid, rid);
+            } catch (const std::exception &e) {
+                std::cerr << "Could not remove the region of " << file.source << ": " << e.what() << std::endl;
+            }
+            throw;
+        }
+        bytes_written += file.size;
+        add_put(file.key, std::string(rid));
+        // put even when empty, so a re-ingested path drops its old statistics
+        add_put(StatsKey(file.key), file_stats(file));
+    }
+
+    void run() {
+        std::vector<char> chunk(options.chunk_size);
+        while (!failed) {
+            size_t i = next_file++;
+            if (i >= options.files.size()) {
+                break;
+            }
+            try {
+                ingest_file(options.files[i], chunk);
+            } catch (const std::exception &e) {
+                std::cerr << "Error: " << options.files[i].source << ": " << e.what() << std::endl;
+                failed = true;
+            }
+        }
+    }
+};
+
+static void ingest_ult(void *arg) {
+    static_cast<Ingest*>(arg)->run();
+}
+
+int main(int argc, char* argv[]) {
+    IngestOptions options = parse_options(argc, argv);
+    if (options.files.empty()) {
+        std::cout << "./bake_ingest <file|directory|@list>... [--chunk-size=N] [--files-in-flight=N]\n"
+                     "  [--put-batch=N] [--bake-config=<file>] [--yokan-config=<file>] [--address=<addr>]\n"
+                     "\n@list has one \"source [key]\" per line; keys default to the source path\n";
+        return 0;
+    }
+
+    // initialize margo with a progress thread, so the providers keep
+    // serving while the ingest ULTs block on file reads
+    margo_instance_id mid = margo_init(options.address.c_str(), MARGO_SERVER_MODE, 1, options.files_in_flight);
+    if (mid == MARGO_INSTANCE_NULL) {
+        std::cerr << "Error: margo_init()\n";
+        return -1;
+    }
+
+    hg_addr_t svr_addr;
+    hg_return_t hret = margo_addr_self(mid, &svr_addr);
+    if (hret != HG_SUCCESS) {
+        std::cerr << "Error: margo_addr_lookup()\n";
+        margo_finalize(mid);
+        return -1;
+    }
+
+    // setup the bake provider
+    char *bake_config = read_input_file(options.bake_config.c_str());
+    bk::provider *p = bk::provider::create(
+        mid, 0, ABT_POOL_NULL, std::string(bake_config, strlen(bake_config) + 1), ABT_IO_INSTANCE_NULL, NULL, NULL);
+
+    bk::client bcl(mid);
+    bk::provider_handle bph(bcl, svr_addr, 0);
+    bph.set_eager_limit(0);
+    bk::target tid = p->list_targets()[0];
+
+    // start yokan provider, create a database, and initialize the db handle
+    char *yokan_config = read_input_file(options.yokan_config.c_str());
+    yk::Provider yp(mid, 0, "ABCD", yokan_config, ABT_POOL_NULL, nullptr);
+    yk::Client ycl(mid);
+    yk::Admin admin(mid);
+    yk_database_id_t db_id = admin.openDatabase(svr_addr, 0, "ABCD", "rocksdb", yokan_config);
+    yk::Database db(ycl.handle(), svr_addr, 0, db_id);
+
+    // one ULT per file in flight, each on its own execution stream
+    auto begin = std::chrono::steady_clock::now();
+    Ingest ingest(options, bcl, bph, tid, db);
+    ABT_pool pool;
+    ABT_pool_create_basic(ABT_POOL_FIFO, ABT_POOL_ACCESS_MPMC, ABT_TRUE, &pool);
+    std::vector<ABT_xstream> xstreams(options.files_in_flight);
+    std::vector<ABT_thread> ults(options.files_in_flight);
+    for (int i = 0; i < options.files_in_flight; i++) {
+        ABT_xstream_create_basic(ABT_SCHED_DEFAULT, 1, &pool, ABT_SCHED_CONFIG_NULL, &xstreams[i]);
+    }
+    for (int i = 0; i < options.files_in_flight; i++) {
+        ABT_thread_create(pool, ingest_ult, &ingest, ABT_THREAD_ATTR_NULL, &ults[i]);
+    }
+    for (int i = 0; i < options.files_in_flight; i++) {
+        ABT_thread_join(ults[i]);
+        ABT_thread_free(&ults[i]);
+    }
+    for (int i = 0; i < options.files_in_flight; i++) {
+        ABT_xstream_join(xstreams[i]);
+        ABT_xstream_free(&xstreams[i]);
+    }
+    ingest.flush_puts();
+    // servers drop their cached path->region lookups when this changes
+    std::string generation = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    db.put(kIngestGenerationKey.data(), kIngestGenerationKey.size(), generation.data(), generation.size());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::cout << "Ingested " << options.files.size() << " files, " << ingest.bytes_written << " bytes in "
+              << seconds << " s" << std::endl;
+
+    // free resources
+    free(bake_config);
+    free(yokan_config);
+    margo_addr_free(mid, svr_addr);
+    margo_finalize(mid);
+    return ingest.failed ? 1 : 0;
+}
+
+static char* read_input_file(const char* path) {
+    size_t ret;
+    FILE*  fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(-1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t sz = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* buf = (char*)calloc(1, sz + 1);
+    ret       = fread(buf, 1, sz, fp);
+    if (ret != sz && ferror(fp)) {
+        free(buf);
+        perror("read_input_file");
+        buf = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
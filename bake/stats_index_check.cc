@@ -0,0 +1,69 @@
+#include <iostream>
+
+#include <arrow/api.h>
+#include <arrow/io/memory.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/arrow/writer.h>
+
+#include "stats_index.h"
+
+namespace cp = arrow::compute;
+
+// Writes a file of two row groups, x in [1, 3] and then in [10, 12] with a
+// null, and checks which filters their statistics prune.
+arrow::Status Main() {
+    arrow::Int64Builder builder;
+    ARROW_RETURN_NOT_OK(builder.AppendValues({1, 2, 3, 10}));
+    ARROW_RETURN_NOT_OK(builder.AppendNull());
+    ARROW_RETURN_NOT_OK(builder.Append(12));
+    std::shared_ptr<arrow::Array> x;
+    ARROW_RETURN_NOT_OK(builder.Finish(&x));
+    auto schema = arrow::schema({arrow::field("x", arrow::int64())});
+    auto table = arrow::Table::Make(schema, {x});
+
+    ARROW_ASSIGN_OR_RAISE(auto output, arrow::io::BufferOutputStream::Create());
+    ARROW_RETURN_NOT_OK(parquet::arrow::WriteTable(*table, arrow::default_memory_pool(), output, 3));
+    ARROW_ASSIGN_OR_RAISE(auto file, output->Finish());
+
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::make_shared<arrow::io::BufferReader>(file),
+                                                 arrow::default_memory_pool(), &reader));
+    ARROW_ASSIGN_OR_RAISE(auto stats, ComputeFileStats(*reader));
+    if (stats.row_groups.size() != 2) {
+        return arrow::Status::Invalid("Expected 2 row groups, got ", stats.row_groups.size());
+    }
+
+    auto check = [&](const cp::Expression &guarantee, const std::string &what, const cp::Expression &filter,
+                     bool expected) -> arrow::Status {
+        ARROW_ASSIGN_OR_RAISE(auto bound, filter.Bind(*schema));
+        if (MayMatch(guarantee, bound, *schema) != expected) {
+            return arrow::Status::Invalid(what, " under ", guarantee.ToString(), " should ",
+                                          expected ? "" : "not ", "match ", filter.ToString());
+        }
+        return arrow::Status::OK();
+    };
+    auto x_ref = cp::field_ref("x");
+    // the second row group holds a null, and still prunes
+    ARROW_RETURN_NOT_OK(check(stats.row_groups[0], "row group 0", cp::greater(x_ref, cp::literal(5)), false));
+    ARROW_RETURN_NOT_OK(check(stats.row_groups[1], "row group 1", cp::greater(x_ref, cp::literal(5)), true));
+    ARROW_RETURN_NOT_OK(check(stats.row_groups[1], "row group 1", cp::less(x_ref, cp::literal(5)), false));
+    ARROW_RETURN_NOT_OK(check(stats.row_groups[1], "row group 1", cp::is_null(x_ref), true));
+    ARROW_RETURN_NOT_OK(check(stats.file, "the file", cp::greater(x_ref, cp::literal(100)), false));
+    ARROW_RETURN_NOT_OK(check(stats.file, "the file", cp::greater(x_ref, cp::literal(5)), true));
+
+    // and the same once serialized, as bake_ingest stores them
+    ARROW_ASSIGN_OR_RAISE(auto serialized, SerializeFileStats(stats));
+    ARROW_ASSIGN_OR_RAISE(auto parsed, ParseFileStats(serialized));
+    ARROW_RETURN_NOT_OK(check(parsed.row_groups[1], "parsed row group 1", cp::less(x_ref, cp::literal(5)), false));
+    return arrow::Status::OK();
+}
+
+int main() {
+    arrow::Status s = Main();
+    if (!s.ok()) {
+        std::cerr << s.ToString() << std::endl;
+        return 1;
+    }
+    std::cout << "ok" << std::endl;
+    return 0;
+}
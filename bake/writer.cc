@@ -1,4 +1,5 @@
 #include <sys/stat.h>
+#include <chrono>
 #include <memory>
 #include <fstream>
 #include <iostream>
@@ -10,6 +11,11 @@
 #include <yokan/cxx/admin.hpp>
 #include <yokan/cxx/client.hpp>
 
+#include <arrow/io/memory.h>
+
+#include "catalog.h"
+#include "stats_index.h"
+
 static char* read_input_file(const char* path);
 
 namespace bk = bake;
@@ -75,6 +81,17 @@ int main(int argc, char* argv[]) {
 
     // write file metadata to yokan
     db.put((void*)filename, strlen(filename), (void*)rid_str.c_str(), rid_str.length());
+    // the file's statistics replace those of whatever the path held before;
+    // an empty value means there are none to prune with
+    auto stats = ReadFileStats(std::make_shared<arrow::io::BufferReader>(buffer, buffer_size));
+    std::string stats_str = stats.ok() ? *stats : "";
+    if (!stats.ok()) {
+        std::cerr << "No statistics for " << path << ": " << stats.status().ToString() << std::endl;
+    }
+    std::string stats_key = StatsKey(filename);
+    db.put(stats_key.data(), stats_key.size(), stats_str.data(), stats_str.size());
+    std::string generation = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    db.put(kIngestGenerationKey.data(), kIngestGenerationKey.size(), generation.data(), generation.size());
     
     // free resources
     free(buffer);
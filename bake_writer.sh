@@ -1,6 +1,10 @@
 #!/bin/bash
 set -ex
 
+# one ingest process for the whole dataset: 400 copies of the file, each
+# under its own key
 for i in {1..400}; do
-    ./bin/bake_writer $(pwd)/16MB.uncompressed.parquet /mnt/cephfs/dataset/16MB.uncompressed.parquet.${i}
-done
+    echo "$(pwd)/16MB.uncompressed.parquet /mnt/cephfs/dataset/16MB.uncompressed.parquet.${i}"
+done > ingest_list.txt
+
+./bin/bake_ingest @ingest_list.txt "$@"
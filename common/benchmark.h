@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/util/byte_size.h>
+
+
+// Options shared by the thallium and Flight benchmark clients, passed as
+// --name=value flags alongside each client's positional arguments.
+struct BenchmarkOptions {
+    // the files read are <dataset><i> for i in 1..files
+    std::string dataset = "/mnt/cephfs/dataset/16MB.uncompressed.parquet.";
+    int files = 200;
+    // percentage of rows kept by the filter: 100, 10 or 1
+    std::string selectivity = "100";
+    // whether --selectivity was given, over any positional one
+    bool selectivity_flag = false;
+    // projected columns; empty keeps all of them
+    std::vector<std::string> columns;
+    int warmup = 0;
+    int repetitions = 1;
+    // "json" (one object per line) or "csv"
+    std::string format = "json";
+    // results are appended to this file; empty means stdout
+    std::string output;
+    std::string label;
+    // Chrome trace of client and server spans, in tracing builds
+    std::string trace;
+};
+
+inline std::vector<std::string> SplitList(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Picks the benchmark flags out of argv; everything else is returned in
+// `positional`, in order.
+inline BenchmarkOptions ParseBenchmarkOptions(int argc, char **argv, std::vector<std::string> &positional) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "dataset") {
+            options.dataset = value;
+        } else if (name == "files") {
+            options.files = std::stoi(value);
+        } else if (name == "selectivity") {
+            options.selectivity = value;
+            options.selectivity_flag = true;
+        } else if (name == "columns") {
+            options.columns = SplitList(value);
+        } else if (name == "warmup") {
+            options.warmup = std::stoi(value);
+        } else if (name == "repetitions") {
+            options.repetitions = std::stoi(value);
+        } else if (name == "format") {
+            options.format = value;
+        } else if (name == "output") {
+            options.output = value;
+        } else if (name == "label") {
+            options.label = value;
+        } else if (name == "trace") {
+            options.trace = value;
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+        }
+    }
+    return options;
+}
+
+inline std::string BenchmarkUsage() {
+    return "  [--dataset=<path prefix>] [--files=N] [--selectivity=100|10|1] [--columns=a,b,...]\n"
+           "  [--warmup=N] [--repetitions=N] [--format=json|csv] [--output=<file>] [--label=<name>]\n"
+           "  [--trace=<file>]\n";
+}
+
+inline std::vector<std::string> BenchmarkFiles(const BenchmarkOptions &options) {
+    std::vector<std::string> files;
+    for (int i = 1; i <= options.files; i++) {
+        files.push_back(options.dataset + std::to_string(i));
+    }
+    return files;
+}
+
+// The total_amount thresholds that keep roughly the given share of rows of
+// the NYC taxi dataset.
+inline arrow::compute::Expression SelectivityFilter(const std::string &selectivity) {
+    namespace cp = arrow::compute;
+    if (selectivity == "10") {
+        return cp::greater(cp::field_ref("total_amount"), cp::literal(27));
+    } else if (selectivity == "1") {
+        return cp::greater(cp::field_ref("total_amount"), cp::literal(69));
+    }
+    return cp::greater(cp::field_ref("total_amount"), cp::literal(-200));
+}
+
+// The schema of the NYC taxi files, with the one-character
+// store_and_fwd_flag dictionary-encoded.
+inline std::shared_ptr<arrow::Schema> DatasetSchema() {
+    return arrow::schema({
+        arrow::field("VendorID", arrow::int64()),
+        arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
+        arrow::field("passenger_count", arrow::int64()),
+        arrow::field("trip_distance", arrow::float64()),
+        arrow::field("RatecodeID", arrow::int64()),
+        arrow::field("store_and_fwd_flag", arrow::dictionary(arrow::int32(), arrow::utf8())),
+        arrow::field("PULocationID", arrow::int64()),
+        arrow::field("DOLocationID", arrow::int64()),
+        arrow::field("payment_type", arrow::int64()),
+        arrow::field("fare_amount", arrow::float64()),
+        arrow::field("extra", arrow::float64()),
+        arrow::field("mta_tax", arrow::float64()),
+        arrow::field("tip_amount", arrow::float64()),
+        arrow::field("tolls_amount", arrow::float64()),
+        arrow::field("improvement_surcharge", arrow::float64()),
+        arrow::field("total_amount", arrow::float64())
+    });
+}
+
+inline arrow::Result<std::shared_ptr<arrow::Schema>> ProjectSchema(const std::shared_ptr<arrow::Schema> &schema,
+                                                                   const std::vector<std::string> &columns) {
+    if (columns.empty()) {
+        return schema;
+    }
+    arrow::FieldVector fields;
+    for (const auto &column : columns) {
+        auto field = schema->GetFieldByName(column);
+        if (field == nullptr) {
+            return arrow::Status::Invalid("No column ", column, " in ", schema->ToString());
+        }
+        fields.push_back(field);
+    }
+    return arrow::schema(fields);
+}
+
+inline int64_t BatchBytes(const arrow::RecordBatch &batch) {
+    return arrow::util::TotalBufferSize(batch);
+}
+
+
+// Collects the measurements of a benchmark: per repetition the wall time,
+// rows and bytes received, the time from each scan request to its first
+// batch, and the time between consecutive batches. Repetitions below
+// options.warmup are measured but not reported.
+class BenchmarkRecorder {
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct Run {
+            double seconds = 0;
+            int64_t rows = 0;
+            int64_t bytes = 0;
+            int64_t batches = 0;
+            std::vector<double> ttfb_ms;
+            std::vector<double> batch_ms;
+        };
+
+    public:
+        // when a scan was requested or last received a batch
+        struct Scan {
+            clock::time_point last;
+            bool first = true;
+        };
+
+    private:
+        const BenchmarkOptions &options;
+        std::vector<Run> runs;
+        clock::time_point run_begin;
+        Scan current;
+
+        static double Millis(clock::duration d) {
+            return std::chrono::duration<double, std::milli>(d).count();
+        }
+
+        // nearest-rank percentile
+        static double Percentile(std::vector<double> values, double p) {
+            if (values.empty()) {
+                return 0;
+            }
+            std::sort(values.begin(), values.end());
+            size_t rank = (size_t)std::ceil(p / 100 * values.size());
+            rank = std::min(std::max<size_t>(rank, 1), values.size());
+            return values[rank - 1];
+        }
+
+        static double Mean(const std::vector<double> &values) {
+            double sum = 0;
+            for (double v : values) {
+                sum += v;
+            }
+            return values.empty() ? 0 : sum / values.size();
+        }
+
+        static std::string Quote(const std::string &s) {
+            std::string out = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                }
+                out += c;
+            }
+            return out + "\"";
+        }
+
+    public:
+        explicit BenchmarkRecorder(const BenchmarkOptions &options) : options(options) {}
+
+        void BeginRun() {
+            runs.emplace_back();
+            run_begin = clock::now();
+        }
+
+        void EndRun() {
+            runs.back().seconds = std::chrono::duration<double>(clock::now() - run_begin).count();
+        }
+
+        // a scan request is about to be sent
+        void BeginScan() {
+            current = StartScan();
+        }
+
+        // batches arrived; clients that fetch several batches per round trip
+        // record them together
+        void Batch(int64_t rows, int64_t bytes) {
+            Batch(current, rows, bytes);
+        }
+
+        // the same for clients with several scans in flight, which keep one
+        // Scan each and serialize their calls
+        Scan StartScan() const {
+            Scan scan;
+            scan.last = clock::now();
+            return scan;
+        }
+
+        void Batch(Scan &scan, int64_t rows, int64_t bytes) {
+            clock::time_point now = clock::now();
+            Run &run = runs.back();
+            if (scan.first) {
+                run.ttfb_ms.push_back(Millis(now - scan.last));
+                scan.first = false;
+            }
+            run.batch_ms.push_back(Millis(now - scan.last));
+            run.rows += rows;
+            run.bytes += bytes;
+            run.batches++;
+            scan.last = now;
+        }
+
+        int64_t rows() const { return runs.empty() ? 0 : runs.back().rows; }
+
+        void Report() const {
+            std::ofstream file;
+            bool header = options.format == "csv";
+            if (!options.output.empty()) {
+                header = header && !std::ifstream(options.output).good();
+                file.open(options.output, std::ios::app);
+            }
+            std::ostream &out = options.output.empty() ? std::cout : file;
+
+            std::string columns;
+            for (const auto &column : options.columns) {
+                columns += (columns.empty() ? "" : ";") + column;
+            }
+            if (header) {
+                out << "label,repetition,files,selectivity,columns,seconds,rows,bytes,batches,"
+                       "rows_per_s,bytes_per_s,ttfb_ms,batch_p50_ms,batch_p95_ms,batch_p99_ms\n";
+            }
+            for (size_t i = options.warmup; i < runs.size(); i++) {
+                const Run &run = runs[i];
+                double rows_per_s = run.seconds > 0 ? run.rows / run.seconds : 0;
+                double bytes_per_s = run.seconds > 0 ? run.bytes / run.seconds : 0;
+                if (options.format == "csv") {
+                    out << options.label << "," << i - options.warmup << "," << options.files << ","
+                        << options.selectivity << "," << columns << "," << run.seconds << ","
+                        << run.rows << "," << run.bytes << "," << run.batches << ","
+                        << rows_per_s << "," << bytes_per_s << "," << Mean(run.ttfb_ms) << ","
+                        << Percentile(run.batch_ms, 50) << "," << Percentile(run.batch_ms, 95) << ","
+                        << Percentile(run.batch_ms, 99) << "\n";
+                } else {
+                    out << "{\"label\": " << Quote(options.label)
+                        << ", \"repetition\": " << i - options.warmup
+                        << ", \"files\": " << options.files
+                        << ", \"selectivity\": " << Quote(options.selectivity)
+                        << ", \"columns\": " << Quote(columns)
+                        << ", \"seconds\": " << run.seconds
+                        << ", \"rows\": " << run.rows
+                        << ", \"bytes\": " << run.bytes
+                        << ", \"batches\": " << run.batches
+                        << ", \"rows_per_s\": " << rows_per_s
+                        << ", \"bytes_per_s\": " << bytes_per_s
+                        << ", \"ttfb_ms\": " << Mean(run.ttfb_ms)
+                        << ", \"batch_p50_ms\": " << Percentile(run.batch_ms, 50)
+                        << ", \"batch_p95_ms\": " << Percentile(run.batch_ms, 95)
+                        << ", \"batch_p99_ms\": " << Percentile(run.batch_ms, 99) << "}\n";
+                }
+            }
+        }
+};
+
+// Runs `run` options.warmup + options.repetitions times and reports the
+// measured repetitions.
+inline arrow::Status RunBenchmark(const BenchmarkOptions &options,
+                                  const std::function<arrow::Status(BenchmarkRecorder&)> &run) {
+    BenchmarkRecorder recorder(options);
+    for (int i = 0; i < options.warmup + options.repetitions; i++) {
+        recorder.BeginRun();
+        ARROW_RETURN_NOT_OK(run(recorder));
+        recorder.EndRun();
+        std::cerr << (i < options.warmup ? "warm-up " : "repetition ") << i
+                  << ": " << recorder.rows() << " rows" << std::endl;
+    }
+    recorder.Report();
+    return arrow::Status::OK();
+}
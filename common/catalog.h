@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+
+// Keys of the yokan database that maps dataset paths to bake regions. A
+// path's own key holds its region ID; the keys below sit alongside.
+
+// bumped by every ingest run, so servers know their cached lookups are stale
+const std::string kIngestGenerationKey = "__ingest_generation__";
+
+// a path's statistics index (see stats_index.h), written at ingest
+inline std::string StatsKey(const std::string &path) {
+    return "__stats__:" + path;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Counters and latency histograms the servers keep while they run and
+// report through their stats endpoints. Updates are relaxed atomic adds, so
+// they are cheap enough for the hot path.
+
+class Counter {
+    private:
+        std::atomic<int64_t> value{0};
+
+    public:
+        void add(int64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+        void sub(int64_t n = 1) { value.fetch_sub(n, std::memory_order_relaxed); }
+        int64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// A log-linear histogram of microsecond latencies in the style of HDR
+// histograms: exact below 16us, then 8 buckets per power of two, so any
+// recorded value is off by at most 12.5%.
+class Histogram {
+    private:
+        static const int kLinear = 16;
+        static const int kSubBuckets = 8;
+        static const int kBuckets = kLinear + (64 - 4) * kSubBuckets;
+
+        std::atomic<uint64_t> counts[kBuckets];
+        std::atomic<int64_t> total{0};
+        std::atomic<int64_t> maximum{0};
+
+        static int Index(int64_t v) {
+            if (v < kLinear) {
+                return v < 0 ? 0 : (int)v;
+            }
+            int e = 63 - __builtin_clzll((uint64_t)v);
+            int sub = (int)((v >> (e - 3)) & (kSubBuckets - 1));
+            return kLinear + (e - 4) * kSubBuckets + sub;
+        }
+
+        // the smallest value that lands in bucket i
+        static int64_t LowerBound(int i) {
+            if (i < kLinear) {
+                return i;
+            }
+            int e = (i - kLinear) / kSubBuckets + 4;
+            int sub = (i - kLinear) % kSubBuckets;
+            return (int64_t)(kSubBuckets + sub) << (e - 3);
+        }
+
+    public:
+        Histogram() {
+            for (auto &c : counts) {
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void record(int64_t us) {
+            counts[Index(us)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(us, std::memory_order_relaxed);
+            int64_t m = maximum.load(std::memory_order_relaxed);
+            while (us > m && !maximum.compare_exchange_weak(m, us, std::memory_order_relaxed)) {
+            }
+        }
+
+        void record(std::chrono::steady_clock::duration d) {
+            record(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+        }
+
+        // count, mean, p50/p95/p99, max, and the non-empty buckets as
+        // [lower bound, count] pairs
+        std::string json() const {
+            std::vector<std::pair<int64_t, uint64_t>> buckets;
+            uint64_t count = 0;
+            for (int i = 0; i < kBuckets; i++) {
+                uint64_t c = counts[i].load(std::memory_order_relaxed);
+                if (c > 0) {
+                    buckets.emplace_back(LowerBound(i), c);
+                    count += c;
+                }
+            }
+            // nearest rank, as BenchmarkRecorder::Percentile computes it
+            auto percentile = [&](double p) -> int64_t {
+                uint64_t rank = std::max<uint64_t>((uint64_t)std::ceil(p / 100 * count), 1);
+                uint64_t seen = 0;
+                for (const auto &b : buckets) {
+                    seen += b.second;
+                    if (seen >= rank && seen > 0) {
+                        return b.first;
+                    }
+                }
+                return 0;
+            };
+            std::ostringstream out;
+            out << "{\"count\": " << count
+                << ", \"mean_us\": " << (count > 0 ? total.load(std::memory_order_relaxed) / (int64_t)count : 0)
+                << ", \"p50_us\": " << percentile(50)
+                << ", \"p95_us\": " << percentile(95)
+                << ", \"p99_us\": " << percentile(99)
+                << ", \"max_us\": " << maximum.load(std::memory_order_relaxed)
+                << ", \"buckets\": [";
+            for (size_t i = 0; i < buckets.size(); i++) {
+                out << (i > 0 ? ", " : "") << "[" << buckets[i].first << ", " << buckets[i].second << "]";
+            }
+            out << "]}";
+            return out.str();
+        }
+};
+
+// Records the time from its construction to its destruction.
+class ScopedTimer {
+    private:
+        Histogram &histogram;
+        std::chrono::steady_clock::time_point begin;
+
+    public:
+        explicit ScopedTimer(Histogram &histogram)
+            : histogram(histogram), begin(std::chrono::steady_clock::now()) {}
+
+        ~ScopedTimer() { histogram.record(std::chrono::steady_clock::now() - begin); }
+};
+
+// Builds the flat JSON object a stats endpoint returns.
+class StatsWriter {
+    private:
+        std::ostringstream out;
+        bool first = true;
+
+        void key(const std::string &name) {
+            out << (first ? "{" : ", ") << "\"" << name << "\": ";
+            first = false;
+        }
+
+    public:
+        StatsWriter& add(const std::string &name, int64_t value) {
+            key(name);
+            out << value;
+            return *this;
+        }
+
+        StatsWriter& add(const std::string &name, const Histogram &histogram) {
+            key(name);
+            out << histogram.json();
+            return *this;
+        }
+
+        std::string str() {
+            return (first ? "{" : "") + out.str() + "}";
+        }
+};
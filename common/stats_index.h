@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/io/interfaces.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/metadata.h>
+#include <parquet/statistics.h>
+
+
+// Min/max/null-count statistics of a Parquet file, kept as Arrow guarantee
+// expressions: per row group, the conjunction of "column >= min" and
+// "column <= max" (each "or null", where a chunk has nulls) over its
+// columns, and for the file, the same over each column's range across all
+// row groups. A filter that simplifies to unsatisfiable under a guarantee
+// matches none of its rows.
+struct FileStats {
+    arrow::compute::Expression file;
+    std::vector<arrow::compute::Expression> row_groups;
+};
+
+namespace stats_internal {
+
+inline std::shared_ptr<arrow::Scalar> StatScalar(const parquet::Statistics &stats, bool min) {
+    switch (stats.physical_type()) {
+        case parquet::Type::INT32: {
+            const auto &s = static_cast<const parquet::Int32Statistics&>(stats);
+            return arrow::MakeScalar(min ? s.min() : s.max());
+        }
+        case parquet::Type::INT64: {
+            const auto &s = static_cast<const parquet::Int64Statistics&>(stats);
+            return arrow::MakeScalar(min ? s.min() : s.max());
+        }
+        case parquet::Type::FLOAT: {
+            const auto &s = static_cast<const parquet::FloatStatistics&>(stats);
+            return arrow::MakeScalar(min ? s.min() : s.max());
+        }
+        case parquet::Type::DOUBLE: {
+            const auto &s = static_cast<const parquet::DoubleStatistics&>(stats);
+            return arrow::MakeScalar(min ? s.min() : s.max());
+        }
+        case parquet::Type::BYTE_ARRAY: {
+            const auto &s = static_cast<const parquet::ByteArrayStatistics&>(stats);
+            parquet::ByteArray v = min ? s.min() : s.max();
+            return std::make_shared<arrow::StringScalar>(std::string((const char*)v.ptr, v.len));
+        }
+        default:
+            return nullptr;
+    }
+}
+
+// The min and max of a column chunk in the column's Arrow type, false if
+// its statistics have none that can be expressed in it.
+inline bool ColumnRange(const arrow::Field &field, const parquet::Statistics &stats,
+                        std::shared_ptr<arrow::Scalar> &min, std::shared_ptr<arrow::Scalar> &max) {
+    if (!stats.HasMinMax() || field.type()->id() == arrow::Type::DICTIONARY) {
+        return false;
+    }
+    min = StatScalar(stats, true);
+    max = StatScalar(stats, false);
+    if (min == nullptr || max == nullptr) {
+        return false;
+    }
+    if (!min->type->Equals(*field.type())) {
+        auto cast_min = min->CastTo(field.type());
+        auto cast_max = max->CastTo(field.type());
+        if (!cast_min.ok() || !cast_max.ok()) {
+            return false;
+        }
+        min = *cast_min;
+        max = *cast_max;
+    }
+    return true;
+}
+
+inline bool AllNull(const parquet::Statistics &stats) {
+    return stats.HasNullCount() && stats.num_values() == 0 && stats.null_count() > 0;
+}
+
+inline bool MayHaveNulls(const parquet::Statistics &stats) {
+    return !stats.HasNullCount() || stats.null_count() > 0;
+}
+
+// Adds "column >= min" and "column <= max" to `conjunction`, each "or null"
+// where the column may have nulls. SimplifyWithGuarantee only takes bounds
+// from a comparison, or one or'd with is_null, so the two stay separate.
+inline void AddRangeGuarantee(std::vector<arrow::compute::Expression> &conjunction, const arrow::Field &field,
+                              const std::shared_ptr<arrow::Scalar> &min,
+                              const std::shared_ptr<arrow::Scalar> &max, bool nulls) {
+    namespace cp = arrow::compute;
+    auto ref = cp::field_ref(field.name());
+    for (auto bound : {cp::greater_equal(ref, cp::literal(min)), cp::less_equal(ref, cp::literal(max))}) {
+        conjunction.push_back(nulls ? cp::or_(bound, cp::is_null(ref)) : bound);
+    }
+}
+
+// Adds what a column chunk's statistics guarantee about the column to
+// `conjunction`; nothing if they cannot be expressed in its Arrow type.
+inline void AddColumnGuarantee(std::vector<arrow::compute::Expression> &conjunction, const arrow::Field &field,
+                               const parquet::Statistics &stats) {
+    namespace cp = arrow::compute;
+    if (AllNull(stats)) {
+        conjunction.push_back(cp::is_null(cp::field_ref(field.name())));
+        return;
+    }
+    std::shared_ptr<arrow::Scalar> min, max;
+    if (ColumnRange(field, stats, min, max)) {
+        AddRangeGuarantee(conjunction, field, min, max, MayHaveNulls(stats));
+    }
+}
+
+// The smallest and largest of `scalars`, all of the field's type.
+inline arrow::Status MinMaxOf(const arrow::Field &field, const arrow::ScalarVector &scalars,
+                              std::shared_ptr<arrow::Scalar> &min, std::shared_ptr<arrow::Scalar> &max) {
+    std::unique_ptr<arrow::ArrayBuilder> builder;
+    ARROW_RETURN_NOT_OK(arrow::MakeBuilder(arrow::default_memory_pool(), field.type(), &builder));
+    ARROW_RETURN_NOT_OK(builder->AppendScalars(scalars));
+    ARROW_ASSIGN_OR_RAISE(auto array, builder->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto min_max, arrow::compute::MinMax(array));
+    const auto &pair = static_cast<const arrow::StructScalar&>(*min_max.scalar());
+    min = pair.value[0];
+    max = pair.value[1];
+    return arrow::Status::OK();
+}
+
+inline void PutBytes(std::string &out, const std::string &bytes) {
+    uint64_t size = bytes.size();
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.append(bytes);
+}
+
+inline arrow::Result<std::string> GetBytes(const std::string &in, size_t &pos) {
+    uint64_t size;
+    if (pos + sizeof(size) > in.size()) {
+        return arrow::Status::Invalid("Truncated file statistics");
+    }
+    memcpy(&size, in.data() + pos, sizeof(size));
+    pos += sizeof(size);
+    if (pos + size > in.size()) {
+        return arrow::Status::Invalid("Truncated file statistics");
+    }
+    pos += size;
+    return in.substr(pos - size, size);
+}
+
+}  // namespace stats_internal
+
+// Reads the statistics out of a file's footer. The file's guarantee is, per
+// column, the range from the smallest row group min to the largest row
+// group max, which SimplifyWithGuarantee can use as it is a conjunction;
+// columns some row group has no usable statistics for are left out.
+inline arrow::Result<FileStats> ComputeFileStats(parquet::arrow::FileReader &reader) {
+    namespace cp = arrow::compute;
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader.GetSchema(&schema));
+    auto metadata = reader.parquet_reader()->metadata();
+
+    FileStats stats;
+    for (int rg = 0; rg < metadata->num_row_groups(); rg++) {
+        auto row_group = metadata->RowGroup(rg);
+        std::vector<cp::Expression> columns;
+        for (const auto &field : schema->fields()) {
+            int column = metadata->schema()->ColumnIndex(field->name());
+            if (column < 0) {
+                continue;
+            }
+            auto chunk = row_group->ColumnChunk(column);
+            if (chunk->is_stats_set() && chunk->statistics() != nullptr) {
+                stats_internal::AddColumnGuarantee(columns, *field, *chunk->statistics());
+            }
+        }
+        stats.row_groups.push_back(cp::and_(columns));
+    }
+
+    std::vector<cp::Expression> file_columns;
+    for (const auto &field : schema->fields()) {
+        int column = metadata->schema()->ColumnIndex(field->name());
+        if (column < 0 || metadata->num_row_groups() == 0) {
+            continue;
+        }
+        arrow::ScalarVector mins, maxs;
+        bool usable = true;
+        bool nulls = false;
+        for (int rg = 0; rg < metadata->num_row_groups() && usable; rg++) {
+            auto chunk = metadata->RowGroup(rg)->ColumnChunk(column);
+            if (!chunk->is_stats_set() || chunk->statistics() == nullptr) {
+                usable = false;
+                break;
+            }
+            const parquet::Statistics &chunk_stats = *chunk->statistics();
+            nulls = nulls || stats_internal::MayHaveNulls(chunk_stats);
+            if (stats_internal::AllNull(chunk_stats)) {
+                continue;
+            }
+            std::shared_ptr<arrow::Scalar> min, max;
+            usable = stats_internal::ColumnRange(*field, chunk_stats, min, max);
+            mins.push_back(min);
+            maxs.push_back(max);
+        }
+        if (!usable) {
+            continue;
+        }
+        if (mins.empty()) {
+            file_columns.push_back(cp::is_null(cp::field_ref(field->name())));
+            continue;
+        }
+        std::shared_ptr<arrow::Scalar> min, max, unused;
+        if (!stats_internal::MinMaxOf(*field, mins, min, unused).ok() ||
+            !stats_internal::MinMaxOf(*field, maxs, unused, max).ok()) {
+            continue;
+        }
+        stats_internal::AddRangeGuarantee(file_columns, *field, min, max, nulls);
+    }
+    stats.file = cp::and_(file_columns);
+    return stats;
+}
+
+inline arrow::Result<std::string> SerializeFileStats(const FileStats &stats) {
+    std::string out;
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::compute::Serialize(stats.file));
+    stats_internal::PutBytes(out, file->ToString());
+    for (const auto &row_group : stats.row_groups) {
+        ARROW_ASSIGN_OR_RAISE(auto buffer, arrow::compute::Serialize(row_group));
+        stats_internal::PutBytes(out, buffer->ToString());
+    }
+    return out;
+}
+
+inline arrow::Result<FileStats> ParseFileStats(const std::string &in) {
+    FileStats stats;
+    size_t pos = 0;
+    ARROW_ASSIGN_OR_RAISE(auto file, stats_internal::GetBytes(in, pos));
+    ARROW_ASSIGN_OR_RAISE(stats.file, arrow::compute::Deserialize(arrow::Buffer::FromString(file)));
+    while (pos < in.size()) {
+        ARROW_ASSIGN_OR_RAISE(auto row_group, stats_internal::GetBytes(in, pos));
+        ARROW_ASSIGN_OR_RAISE(auto expr, arrow::compute::Deserialize(arrow::Buffer::FromString(row_group)));
+        stats.row_groups.push_back(expr);
+    }
+    return stats;
+}
+
+// A Parquet file's statistics, read from its footer and serialized.
+inline arrow::Result<std::string> ReadFileStats(std::shared_ptr<arrow::io::RandomAccessFile> input) {
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    ARROW_ASSIGN_OR_RAISE(auto stats, ComputeFileStats(*reader));
+    return SerializeFileStats(stats);
+}
+
+// Whether rows under `guarantee` may pass `bound_filter`, already bound to
+// `schema`. Anything that cannot be evaluated may match.
+inline bool MayMatch(const arrow::compute::Expression &guarantee, const arrow::compute::Expression &bound_filter,
+                     const arrow::Schema &schema) {
+    auto bound_guarantee = guarantee.Bind(schema);
+    if (!bound_guarantee.ok()) {
+        return true;
+    }
+    auto simplified = arrow::compute::SimplifyWithGuarantee(bound_filter, *bound_guarantee);
+    return !simplified.ok() || simplified->IsSatisfiable();
+}
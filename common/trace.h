@@ -0,0 +1,191 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Hot-path trace spans. Spans are only recorded in builds configured with
+// -DTRACING=ON (which defines ENABLE_TRACING); otherwise the TRACE_* macros
+// compile to nothing. Every thread writes its spans into a ring buffer of
+// its own, so recording takes no locks; the oldest spans are overwritten
+// once a ring is full. Traces are written in Chrome's trace-event format
+// (chrome://tracing, Perfetto) with the request ID of each span in its args.
+
+// Wall-clock microseconds, so spans of a client and a server on different
+// hosts line up as far as their clocks agree.
+inline int64_t TraceNow() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent {
+    const char *name;
+    int tid;
+    uint64_t request_id;
+    int64_t begin;
+    int64_t end;
+    // async spans may overlap others on their thread, e.g. a batch waiting in a queue
+    bool async;
+};
+
+class TraceBuffer {
+    private:
+        std::vector<TraceEvent> events;
+        std::atomic<uint64_t> head{0};
+
+    public:
+        const int tid;
+
+        TraceBuffer(size_t capacity, int tid) : events(capacity), tid(tid) {}
+
+        void Record(const TraceEvent &event) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            events[h % events.size()] = event;
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        // The recorded events, oldest first. Spans recorded while this runs
+        // may show up torn, so dump traces once the workload has quiesced.
+        std::vector<TraceEvent> Snapshot() const {
+            uint64_t h = head.load(std::memory_order_acquire);
+            uint64_t n = std::min<uint64_t>(h, events.size());
+            std::vector<TraceEvent> out;
+            for (uint64_t i = h - n; i < h; i++) {
+                out.push_back(events[i % events.size()]);
+            }
+            return out;
+        }
+};
+
+class Tracer {
+    private:
+        static const size_t kEventsPerThread = 1 << 16;
+
+        std::mutex m;
+        std::vector<std::shared_ptr<TraceBuffer>> buffers;
+        std::string process_name = "process";
+
+        TraceBuffer& Register() {
+            std::lock_guard<std::mutex> lock(m);
+            buffers.push_back(std::make_shared<TraceBuffer>(kEventsPerThread, (int)buffers.size()));
+            return *buffers.back();
+        }
+
+    public:
+        static Tracer& Get() {
+            static Tracer tracer;
+            return tracer;
+        }
+
+        TraceBuffer& Local() {
+            thread_local TraceBuffer *buffer = &Register();
+            return *buffer;
+        }
+
+        void SetProcessName(const std::string &name) { process_name = name; }
+
+        int ThreadId() { return Local().tid; }
+
+        void Record(const char *name, uint64_t request_id, int64_t begin, int64_t end) {
+            TraceBuffer &buffer = Local();
+            buffer.Record({name, buffer.tid, request_id, begin, end, false});
+        }
+
+        // Records a span that ran on thread `tid`, e.g. for a batch whose
+        // request ID is only known after it was produced. It goes into the
+        // calling thread's ring, which keeps every ring single-writer.
+        void RecordFor(int tid, const char *name, uint64_t request_id, int64_t begin, int64_t end,
+                       bool async = false) {
+            Local().Record({name, tid, request_id, begin, end, async});
+        }
+
+        // The events of this process as comma-separated trace-event objects,
+        // to be merged with the events of the other side of a connection.
+        std::string Events() {
+            std::ostringstream out;
+            int pid = getpid();
+            out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+                << ", \"args\": {\"name\": \"" << process_name << "\"}}";
+            std::vector<std::shared_ptr<TraceBuffer>> all;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                all = buffers;
+            }
+            uint64_t async_id = 0;
+            for (const auto &buffer : all) {
+                for (const auto &event : buffer->Snapshot()) {
+                    std::ostringstream common;
+                    common << "\"name\": \"" << event.name << "\", \"pid\": " << pid
+                           << ", \"tid\": " << event.tid
+                           << ", \"args\": {\"request_id\": \"" << event.request_id << "\"}";
+                    if (event.async) {
+                        async_id++;
+                        out << ",\n{" << common.str() << ", \"cat\": \"async\", \"ph\": \"b\", \"id\": "
+                            << async_id << ", \"ts\": " << event.begin << "}";
+                        out << ",\n{" << common.str() << ", \"cat\": \"async\", \"ph\": \"e\", \"id\": "
+                            << async_id << ", \"ts\": " << event.end << "}";
+                    } else {
+                        out << ",\n{" << common.str() << ", \"ph\": \"X\", \"ts\": " << event.begin
+                            << ", \"dur\": " << event.end - event.begin << "}";
+                    }
+                }
+            }
+            return out.str();
+        }
+
+        // Writes the events of this process, and optionally those of the
+        // remote side, as one trace file.
+        void Dump(const std::string &path, const std::string &remote_events = "") {
+            std::ofstream out(path);
+            out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n" << Events();
+            if (!remote_events.empty()) {
+                out << ",\n" << remote_events;
+            }
+            out << "\n]}\n";
+        }
+};
+
+// Records the time from its construction to its destruction as a span.
+class TraceSpan {
+    private:
+        const char *name;
+        uint64_t request_id;
+        int64_t begin;
+
+    public:
+        TraceSpan(const char *name, uint64_t request_id)
+            : name(name), request_id(request_id), begin(TraceNow()) {}
+
+        ~TraceSpan() {
+            Tracer::Get().Record(name, request_id, begin, TraceNow());
+        }
+};
+
+// Request IDs are unique across the processes of one run: the client's pid
+// in the upper half, a counter in the lower half.
+inline uint64_t NextRequestId() {
+    static std::atomic<uint32_t> counter{0};
+    return ((uint64_t)getpid() << 32) | ++counter;
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef ENABLE_TRACING
+#define TRACE_SPAN(name, request_id) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, request_id)
+#define TRACE_RECORD(name, request_id, begin, end) Tracer::Get().Record(name, request_id, begin, end)
+#define TRACE_NOW() TraceNow()
+#else
+#define TRACE_SPAN(name, request_id)
+#define TRACE_RECORD(name, request_id, begin, end)
+#define TRACE_NOW() int64_t(0)
+#endif
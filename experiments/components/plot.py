@@ -1,32 +1,41 @@
 import os
+import sys
 import pandas as pd
 import seaborn as sns
 import matplotlib.pyplot as plt
 
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+from results import read_results
+
+
 if __name__ == "__main__":
-    data = {
-        "latency(s)": list(),
-        "mode": list()
-    }
+    if len(sys.argv) > 1:
+        df = read_results(sys.argv[1:])
+        df = df.rename(columns={"seconds": "latency(s)", "label": "mode"})
+    else:
+        data = {
+            "latency(s)": list(),
+            "mode": list()
+        }
+
+        filelist = [
+            "skyhook-cephfs",
+            "flight-ext4",
+            "thallium-ext4",
+            "thallium-ext4mmap",
+            "thallium-bake"
+        ]
 
-    filelist = [
-        "skyhook-cephfs",
-        "flight-ext4",
-        "thallium-ext4",
-        "thallium-ext4mmap",
-        "thallium-bake"
-    ]
+        for filename in filelist:
+            with open(filename, "r") as fd:
+                lines = fd.readlines()
+                lines = lines[6:]
+                lines = [float(l.rstrip()) for l in lines]
+                for l in lines:
+                    data['latency(s)'].append(l)
+                    data['mode'].append(filename)
 
-    for filename in filelist:
-        with open(filename, "r") as fd:
-            lines = fd.readlines()
-            lines = lines[6:]
-            lines = [float(l.rstrip()) for l in lines]
-            for l in lines:
-                data['latency(s)'].append(l)
-                data['mode'].append(filename)
-                
-    df = pd.DataFrame(data)
+        df = pd.DataFrame(data)
     print(df)
     sns_plot = sns.barplot(x="mode", y="latency(s)", data=df)
     plt.title("Mochi/Flight/Skyhook")
@@ -1,9 +1,31 @@
 import os
+import sys
 import pandas as pd
 import seaborn as sns
 import matplotlib.pyplot as plt
 
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+from results import read_results
+
+
 if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        df = read_results(sys.argv[1:])
+        df = df.rename(columns={"seconds": "latency", "label": "mode"})
+        print(df)
+
+        fig, axes = plt.subplots(1, 2, figsize=(10, 4))
+        sns.barplot(x="mode", y="latency", data=df, ax=axes[0])
+        axes[0].set_title("Latency (s)")
+        percentiles = df.melt(id_vars=["mode"],
+                              value_vars=["batch_p50_ms", "batch_p95_ms", "batch_p99_ms"],
+                              var_name="percentile", value_name="batch latency (ms)")
+        sns.barplot(x="percentile", y="batch latency (ms)", hue="mode", data=percentiles, ax=axes[1])
+        axes[1].set_title("Per-batch latency")
+        plt.tight_layout()
+        plt.savefig('latency.pdf')
+        sys.exit(0)
+
     data = {
         "latency": list(),
         "mode": list()
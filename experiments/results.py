@@ -0,0 +1,12 @@
+import pandas as pd
+
+
+def read_results(paths):
+    # output of the tc/fc --output flag: JSON lines or CSV
+    frames = list()
+    for path in paths:
+        if path.endswith(".csv"):
+            frames.append(pd.read_csv(path))
+        else:
+            frames.append(pd.read_json(path, lines=True))
+    return pd.concat(frames, ignore_index=True)
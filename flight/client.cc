@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <time.h>
 
 #include <arrow/api.h>
@@ -7,65 +11,208 @@
 #include <arrow/ipc/api.h>
 #include <arrow/io/api.h>
 
-class MeasureExecutionTime{
-  private:
-      const std::chrono::steady_clock::time_point begin;
-      const std::string caller;
-  public:
-      MeasureExecutionTime(const std::string& caller):caller(caller),begin(std::chrono::steady_clock::now()){}
-      ~MeasureExecutionTime(){
-          const auto duration=std::chrono::steady_clock::now()-begin;
-          std::cout << (double)std::chrono::duration_cast<std::chrono::milliseconds>(duration).count()/1000<<std::endl;
-      }
-};
-
-#ifndef MEASURE_FUNCTION_EXECUTION_TIME
-#define MEASURE_FUNCTION_EXECUTION_TIME const MeasureExecutionTime measureExecutionTime(__FUNCTION__);
-#endif
+#include "benchmark.h"
+#include "trace.h"
+#include "query.h"
+#include "tuning.h"
 
 struct ConnectionInfo {
   std::string host;
   int32_t port;
 };
 
-arrow::Result<std::unique_ptr<arrow::flight::FlightClient>> ConnectToFlightServer(ConnectionInfo info) {
+arrow::Result<std::unique_ptr<arrow::flight::FlightClient>> ConnectToFlightServer(
+    ConnectionInfo info, const FlightTuning& tuning) {
   arrow::flight::Location location;
   ARROW_RETURN_NOT_OK(
       arrow::flight::Location::ForGrpcTcp(info.host, info.port, &location));
 
+  auto options = arrow::flight::FlightClientOptions::Defaults();
+  SetChannelOptions(tuning, options);
   std::unique_ptr<arrow::flight::FlightClient> client;
-  ARROW_RETURN_NOT_OK(arrow::flight::FlightClient::Connect(location, &client));
+  ARROW_RETURN_NOT_OK(arrow::flight::FlightClient::Connect(location, options, &client));
   return client;
 }
 
-int main(int argc, char *argv[]) {
+// Reads one endpoint's stream batch by batch, so only the batch in hand is
+// held in memory. `mutex` guards the recorder when several streams run at
+// once.
+arrow::Status ReadEndpoint(arrow::flight::FlightClient &client,
+                           const arrow::flight::FlightCallOptions &call_options,
+                           const arrow::flight::FlightEndpoint &endpoint, uint64_t request_id,
+                           BenchmarkRecorder &recorder, BenchmarkRecorder::Scan &scan,
+                           std::mutex &mutex) {
+  std::unique_ptr<arrow::flight::FlightStreamReader> stream;
+  ARROW_RETURN_NOT_OK(client.DoGet(call_options, endpoint.ticket, &stream));
+  while (true) {
+    arrow::flight::FlightStreamChunk chunk;
+    {
+      TRACE_SPAN("next", request_id);
+      ARROW_RETURN_NOT_OK(stream->Next(&chunk));
+    }
+    if (chunk.data == nullptr) {
+      break;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    recorder.Batch(scan, chunk.data->num_rows(), BatchBytes(*chunk.data));
+  }
+  return arrow::Status::OK();
+}
+
+// Reads all endpoints of a FlightInfo, one stream per endpoint, with at
+// most `max_streams` of them open at once.
+arrow::Status ReadEndpoints(arrow::flight::FlightClient &client,
+                            const arrow::flight::FlightCallOptions &call_options,
+                            const arrow::flight::FlightInfo &flight_info, uint64_t request_id,
+                            BenchmarkRecorder &recorder, BenchmarkRecorder::Scan &scan,
+                            std::mutex &mutex, size_t max_streams) {
+  const auto &endpoints = flight_info.endpoints();
+  if (endpoints.size() == 1) {
+    return ReadEndpoint(client, call_options, endpoints[0], request_id, recorder, scan, mutex);
+  }
+  std::vector<arrow::Status> statuses(endpoints.size());
+  std::atomic<size_t> next_endpoint{0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < std::min(endpoints.size(), std::max<size_t>(max_streams, 1)); t++) {
+    threads.emplace_back([&]() {
+      size_t i;
+      while ((i = next_endpoint++) < endpoints.size()) {
+        statuses[i] = ReadEndpoint(client, call_options, endpoints[i], request_id, recorder, scan, mutex);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (const auto &status : statuses) {
+    ARROW_RETURN_NOT_OK(status);
+  }
+  return arrow::Status::OK();
+}
+
+// GetFlightInfo and then all streams of one file.
+arrow::Status ScanFile(arrow::flight::FlightClient &client, FlightQuery query,
+                       BenchmarkRecorder &recorder, std::mutex &mutex, size_t max_streams) {
+  auto descriptor = arrow::flight::FlightDescriptor::Command(SerializeQuery(query));
+
+  // the server tags its spans for this file with the same ID
+  uint64_t request_id = NextRequestId();
+  arrow::flight::FlightCallOptions call_options;
+  call_options.headers.push_back({"x-request-id", std::to_string(request_id)});
+
+  BenchmarkRecorder::Scan scan;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    scan = recorder.StartScan();
+  }
+  std::unique_ptr<arrow::flight::FlightInfo> flight_info;
+  {
+    TRACE_SPAN("get_flight_info", request_id);
+    ARROW_RETURN_NOT_OK(client.GetFlightInfo(call_options, descriptor, &flight_info));
+  }
+  return ReadEndpoints(client, call_options, *flight_info, request_id, recorder, scan, mutex, max_streams);
+}
+
+arrow::Status Main(int argc, char *argv[]) {
+  FlightTuning tuning = ParseFlightTuning(argc, argv);
+  std::vector<std::string> args;
+  BenchmarkOptions options = ParseBenchmarkOptions(argc, argv, args);
+  if (args.empty()) {
+    std::cout << "./fc <port> [host] [streams] [files_in_flight]\n";
+    std::cout << BenchmarkUsage() << FlightTuningUsage();
+    exit(0);
+  }
+
   // Get connection info from user input
   ConnectionInfo info;
+  info.host = args.size() > 1 ? args[1] : "10.10.1.2";
+  info.port = (int32_t)std::stoi(args[0]);
+  // endpoints to split each file into and read in parallel, 0 for one per
+  // row group
+  int64_t streams = args.size() > 2 ? std::stoll(args[2]) : 1;
+  // streams read at once per file; one per core when there is one per row
+  // group
+  size_t max_streams = streams > 0 ? (size_t)streams : std::max(1u, std::thread::hardware_concurrency());
+  // files scanned at once, so the GetFlightInfo of one file overlaps the
+  // streams of the others
+  int files_in_flight = args.size() > 3 ? std::stoi(args[3]) : 1;
 
-  std::string host = "10.10.1.2";
-  info.host = host;
-  info.port = (int32_t)std::stoi(argv[1]);
+  // Connect to flight server
+  ARROW_ASSIGN_OR_RAISE(auto client, ConnectToFlightServer(info, tuning));
+  std::vector<std::string> files = BenchmarkFiles(options);
 
-   // Connect to flight server
-  auto client = ConnectToFlightServer(info).ValueOrDie();
+  // the filter and projection are pushed down to the server
+  auto filter = SelectivityFilter(options.selectivity);
+  std::shared_ptr<arrow::Schema> projection;
+  if (!options.columns.empty()) {
+    ARROW_ASSIGN_OR_RAISE(projection, ProjectSchema(DatasetSchema(), options.columns));
+  }
 
-  {
-    MEASURE_FUNCTION_EXECUTION_TIME
-    for (int i = 1; i <= 200; i++) {
-      std::string filepath = "/mnt/cephfs/dataset/16MB.uncompressed.parquet." + std::to_string(i);
-      auto descriptor = arrow::flight::FlightDescriptor::Path({filepath});
-
-      // Get flight info
-      std::unique_ptr<arrow::flight::FlightInfo> flight_info;
-      client->GetFlightInfo(descriptor, &flight_info);
-
-      // Read table from flight server
-      std::shared_ptr<arrow::Table> table;
-      std::unique_ptr<arrow::flight::FlightStreamReader> stream;
-      client->DoGet(flight_info->endpoints()[0].ticket, &stream);
-      stream->ReadAll(&table);
-      std::cout << table->num_rows() << std::endl;
-      std::cout << table->num_columns() << std::endl;
+  ARROW_RETURN_NOT_OK(RunBenchmark(options, [&](BenchmarkRecorder &recorder) -> arrow::Status {
+    std::mutex mutex;
+    std::atomic<size_t> next_file{0};
+    std::atomic<bool> failed{false};
+    std::vector<arrow::Status> statuses(std::max(files_in_flight, 1));
+
+    // each worker takes the next file as soon as it is done with its last
+    auto worker = [&](int w) {
+      while (!failed) {
+        size_t i = next_file++;
+        if (i >= files.size()) {
+          break;
+        }
+        auto query = MakeQuery(files[i], filter, projection);
+        arrow::Status s = query.status();
+        if (s.ok()) {
+          query->partitions = streams;
+          query->compression = tuning.compression;
+          query->max_batch_bytes = tuning.max_batch_bytes;
+          s = ScanFile(*client, *query, recorder, mutex, max_streams);
+        }
+        if (!s.ok()) {
+          statuses[w] = s;
+          failed = true;
+        }
+      }
+    };
+
+    if (statuses.size() == 1) {
+      worker(0);
+    } else {
+      std::vector<std::thread> workers;
+      for (size_t w = 0; w < statuses.size(); w++) {
+        workers.emplace_back(worker, (int)w);
+      }
+      for (auto &thread : workers) {
+        thread.join();
+      }
     }
+    for (const auto &status : statuses) {
+      ARROW_RETURN_NOT_OK(status);
+    }
+    return arrow::Status::OK();
+  }));
+
+  if (!options.trace.empty()) {
+#ifdef ENABLE_TRACING
+    // one file with the spans of both sides
+    Tracer::Get().SetProcessName("fc");
+    std::unique_ptr<arrow::flight::ResultStream> results;
+    ARROW_RETURN_NOT_OK(client->DoAction({"trace_events", nullptr}, &results));
+    std::unique_ptr<arrow::flight::Result> result;
+    ARROW_RETURN_NOT_OK(results->Next(&result));
+    Tracer::Get().Dump(options.trace, result ? result->body->ToString() : "");
+#else
+    std::cerr << "Built without tracing, configure with -DTRACING=ON" << std::endl;
+#endif
+  }
+  return arrow::Status::OK();
+}
+
+int main(int argc, char *argv[]) {
+  arrow::Status s = Main(argc, argv);
+  if (!s.ok()) {
+    std::cerr << s.ToString() << std::endl;
+    return 1;
   }
 }
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+
+
+// What a Flight client asks of one file: a filter and a projection, both
+// serialized the way the thallium client ships them. Queries travel as a
+// FlightDescriptor command and come back in every ticket of the FlightInfo,
+// so DoGet needs nothing but its ticket.
+struct FlightQuery {
+  std::string path;
+  // serialized arrow::compute::Expression; empty keeps every row
+  std::string filter;
+  // IPC-serialized schema of the projected columns; empty keeps them all
+  std::string projection;
+  // how many endpoints the client wants the file split into, 0 for one per
+  // row group
+  int64_t partitions = 1;
+  // the row groups [begin, end) a ticket covers; end < 0 covers the file
+  int64_t row_group_begin = 0;
+  int64_t row_group_end = -1;
+  // IPC body codec and batch size limit for the stream, see FlightTuning;
+  // empty and 0 take the server's defaults
+  std::string compression;
+  int64_t max_batch_bytes = 0;
+};
+
+// tickets and commands carrying a query start with this, anything else is a
+// bare file path
+static const std::string kQueryMagic = "FLQ1";
+
+namespace query_internal {
+
+inline void PutField(std::string &out, const std::string &field) {
+  uint64_t size = field.size();
+  out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  out.append(field);
+}
+
+inline arrow::Status GetField(const std::string &in, size_t &pos, std::string &field) {
+  uint64_t size;
+  if (pos + sizeof(size) > in.size()) {
+    return arrow::Status::Invalid("Truncated Flight query");
+  }
+  memcpy(&size, in.data() + pos, sizeof(size));
+  pos += sizeof(size);
+  if (pos + size > in.size()) {
+    return arrow::Status::Invalid("Truncated Flight query");
+  }
+  field = in.substr(pos, size);
+  pos += size;
+  return arrow::Status::OK();
+}
+
+inline void PutInt(std::string &out, int64_t value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline arrow::Status GetInt(const std::string &in, size_t &pos, int64_t &value) {
+  if (pos + sizeof(value) > in.size()) {
+    return arrow::Status::Invalid("Truncated Flight query");
+  }
+  memcpy(&value, in.data() + pos, sizeof(value));
+  pos += sizeof(value);
+  return arrow::Status::OK();
+}
+
+}  // namespace query_internal
+
+inline std::string SerializeQuery(const FlightQuery &query) {
+  std::string out = kQueryMagic;
+  query_internal::PutField(out, query.path);
+  query_internal::PutField(out, query.filter);
+  query_internal::PutField(out, query.projection);
+  query_internal::PutInt(out, query.partitions);
+  query_internal::PutInt(out, query.row_group_begin);
+  query_internal::PutInt(out, query.row_group_end);
+  query_internal::PutField(out, query.compression);
+  query_internal::PutInt(out, query.max_batch_bytes);
+  return out;
+}
+
+inline arrow::Result<FlightQuery> ParseQuery(const std::string &in) {
+  FlightQuery query;
+  if (in.compare(0, kQueryMagic.size(), kQueryMagic) != 0) {
+    query.path = in;
+    return query;
+  }
+  size_t pos = kQueryMagic.size();
+  ARROW_RETURN_NOT_OK(query_internal::GetField(in, pos, query.path));
+  ARROW_RETURN_NOT_OK(query_internal::GetField(in, pos, query.filter));
+  ARROW_RETURN_NOT_OK(query_internal::GetField(in, pos, query.projection));
+  ARROW_RETURN_NOT_OK(query_internal::GetInt(in, pos, query.partitions));
+  ARROW_RETURN_NOT_OK(query_internal::GetInt(in, pos, query.row_group_begin));
+  ARROW_RETURN_NOT_OK(query_internal::GetInt(in, pos, query.row_group_end));
+  ARROW_RETURN_NOT_OK(query_internal::GetField(in, pos, query.compression));
+  ARROW_RETURN_NOT_OK(query_internal::GetInt(in, pos, query.max_batch_bytes));
+  return query;
+}
+
+inline arrow::Result<FlightQuery> MakeQuery(const std::string &path,
+                                            const arrow::compute::Expression &filter,
+                                            const std::shared_ptr<arrow::Schema> &projection) {
+  FlightQuery query;
+  query.path = path;
+  ARROW_ASSIGN_OR_RAISE(auto filter_buff, arrow::compute::Serialize(filter));
+  query.filter = filter_buff->ToString();
+  if (projection != nullptr) {
+    ARROW_ASSIGN_OR_RAISE(auto projection_buff, arrow::ipc::SerializeSchema(*projection));
+    query.projection = projection_buff->ToString();
+  }
+  return query;
+}
+
+inline arrow::Result<arrow::compute::Expression> QueryFilter(const FlightQuery &query) {
+  if (query.filter.empty()) {
+    return arrow::compute::literal(true);
+  }
+  return arrow::compute::Deserialize(arrow::Buffer::FromString(query.filter));
+}
+
+// nullptr if the query keeps all columns
+inline arrow::Result<std::shared_ptr<arrow::Schema>> QueryProjection(const FlightQuery &query) {
+  if (query.projection.empty()) {
+    return std::shared_ptr<arrow::Schema>();
+  }
+  arrow::io::BufferReader reader(arrow::Buffer::FromString(query.projection));
+  arrow::ipc::DictionaryMemo memo;
+  return arrow::ipc::ReadSchema(&reader, &memo);
+}
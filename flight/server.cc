@@ -7,31 +7,129 @@
 #include <arrow/filesystem/api.h>
 #include <arrow/ipc/api.h>
 #include <arrow/io/api.h>
+#include <arrow/util/byte_size.h>
 #include "parquet/arrow/reader.h"
 #include "parquet/arrow/schema.h"
 #include "parquet/arrow/writer.h"
 #include "parquet/file_reader.h"
 
+#include "trace.h"
+#include "stats.h"
+#include "query.h"
+#include "tuning.h"
+
+// Live counters, reported by the "stats" action.
+struct ServerStats {
+  Counter streams;
+  Counter active_streams;
+  Counter batches_sent;
+  Counter rows_sent;
+  Counter bytes_sent;
+  Histogram get_flight_info_us;
+  Histogram do_get_us;
+  Histogram scan_batch_us;
+};
+
+ServerStats stats;
+
+// Keeps the request ID a client sent in the x-request-id header, so DoGet
+// can tag its trace spans with it.
+class RequestIdMiddleware : public arrow::flight::ServerMiddleware {
+ public:
+  explicit RequestIdMiddleware(uint64_t request_id) : request_id(request_id) {}
+
+  void SendingHeaders(arrow::flight::AddCallHeaders*) override {}
+  void CallCompleted(const arrow::Status&) override {}
+  std::string name() const override { return "RequestIdMiddleware"; }
+
+  const uint64_t request_id;
+};
+
+class RequestIdMiddlewareFactory : public arrow::flight::ServerMiddlewareFactory {
+ public:
+  arrow::Status StartCall(const arrow::flight::CallInfo&,
+                          const arrow::flight::CallHeaders& incoming_headers,
+                          std::shared_ptr<arrow::flight::ServerMiddleware>* middleware) override {
+    uint64_t request_id = 0;
+    auto it = incoming_headers.find("x-request-id");
+    if (it != incoming_headers.end()) {
+      request_id = std::stoull(std::string(it->second.data(), it->second.size()));
+    }
+    *middleware = std::make_shared<RequestIdMiddleware>(request_id);
+    return arrow::Status::OK();
+  }
+};
+
+// Counts, times and traces every batch the scanner of a DoGet produces.
+// The IPC encoding happens afterwards, on gRPC's threads.
+class InstrumentedReader : public arrow::RecordBatchReader {
+ public:
+  InstrumentedReader(std::shared_ptr<arrow::RecordBatchReader> reader, uint64_t request_id)
+      : reader_(std::move(reader)), request_id_(request_id) {
+    stats.streams.add();
+    stats.active_streams.add();
+  }
+
+  ~InstrumentedReader() override { stats.active_streams.sub(); }
+
+  std::shared_ptr<arrow::Schema> schema() const override { return reader_->schema(); }
+
+  arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override {
+    TRACE_SPAN("scan", request_id_);
+    {
+      ScopedTimer timer(stats.scan_batch_us);
+      ARROW_RETURN_NOT_OK(reader_->ReadNext(batch));
+    }
+    if (*batch != nullptr) {
+      stats.batches_sent.add();
+      stats.rows_sent.add((*batch)->num_rows());
+      stats.bytes_sent.add(arrow::util::TotalBufferSize(**batch));
+    }
+    return arrow::Status::OK();
+  }
+
+ private:
+  std::shared_ptr<arrow::RecordBatchReader> reader_;
+  uint64_t request_id_;
+};
+
 class ParquetStorageService : public arrow::flight::FlightServerBase {
  public:
-  explicit ParquetStorageService(std::shared_ptr<arrow::fs::FileSystem> fs, std::string host, int32_t port)
-      : fs_(std::move(fs)), host_(host), port_(port) {}
+  explicit ParquetStorageService(std::shared_ptr<arrow::fs::FileSystem> fs, std::string host, int32_t port,
+                                 FlightTuning tuning)
+      : fs_(std::move(fs)), host_(host), port_(port), tuning_(std::move(tuning)) {}
 
   int32_t Port() { return port_; }
 
   arrow::Status GetFlightInfo(const arrow::flight::ServerCallContext&,
                               const arrow::flight::FlightDescriptor& descriptor,
                               std::unique_ptr<arrow::flight::FlightInfo>* info) {
-    ARROW_ASSIGN_OR_RAISE(auto file_info, fs_->GetFileInfo(descriptor.path[0]));
-    ARROW_ASSIGN_OR_RAISE(auto flight_info, MakeFlightInfo(file_info));
+    ScopedTimer timer(stats.get_flight_info_us);
+    // a command carries a query, a path asks for the whole file
+    FlightQuery query;
+    if (descriptor.type == arrow::flight::FlightDescriptor::CMD) {
+      ARROW_ASSIGN_OR_RAISE(query, ParseQuery(descriptor.cmd));
+    } else {
+      query.path = descriptor.path[0];
+    }
+    ARROW_ASSIGN_OR_RAISE(auto file_info, fs_->GetFileInfo(query.path));
+    ARROW_ASSIGN_OR_RAISE(auto flight_info, MakeFlightInfo(file_info, query));
     *info = std::unique_ptr<arrow::flight::FlightInfo>(
         new arrow::flight::FlightInfo(std::move(flight_info)));
     return arrow::Status::OK();
   }
 
-  arrow::Status DoGet(const arrow::flight::ServerCallContext&,
+  arrow::Status DoGet(const arrow::flight::ServerCallContext& context,
                       const arrow::flight::Ticket& request,
                       std::unique_ptr<arrow::flight::FlightDataStream>* stream) {
+    uint64_t request_id = 0;
+    auto request_id_middleware = context.GetMiddleware("request-id");
+    if (request_id_middleware != nullptr) {
+      request_id = static_cast<RequestIdMiddleware*>(request_id_middleware)->request_id;
+    }
+    TRACE_SPAN("do_get", request_id);
+    ScopedTimer timer(stats.do_get_us);
+
     // std::string path;
     // ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(request.ticket, &path)); 
     // auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
@@ -40,10 +138,6 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
     // s.base_dir = std::move(path);
     // s.recursive = true;
 
-    auto filter = 
-        arrow::compute::greater(arrow::compute::field_ref("total_amount"),
-                                arrow::compute::literal(-200));
-
     // arrow::dataset::FileSystemFactoryOptions options;
     // ARROW_ASSIGN_OR_RAISE(auto factory, 
     //   arrow::dataset::FileSystemDatasetFactory::Make(std::move(fs), s, std::move(format), options));
@@ -66,71 +160,164 @@ class ParquetStorageService : public arrow::flight::FlightServerBase {
     //     new arrow::flight::RecordBatchStream(reader));
   
     // return arrow::Status::OK();
-    auto schema = arrow::schema({
-        arrow::field("VendorID", arrow::int64()),
-        arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-        arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-        arrow::field("passenger_count", arrow::int64()),
-        arrow::field("trip_distance", arrow::float64()),
-        arrow::field("RatecodeID", arrow::int64()),
-        arrow::field("store_and_fwd_flag", arrow::utf8()),
-        arrow::field("PULocationID", arrow::int64()),
-        arrow::field("DOLocationID", arrow::int64()),
-        arrow::field("payment_type", arrow::int64()),
-        arrow::field("fare_amount", arrow::float64()),
-        arrow::field("extra", arrow::float64()),
-        arrow::field("mta_tax", arrow::float64()),
-        arrow::field("tip_amount", arrow::float64()),
-        arrow::field("tolls_amount", arrow::float64()),
-        arrow::field("improvement_surcharge", arrow::float64()),
-        arrow::field("total_amount", arrow::float64())
-    });
+    ARROW_ASSIGN_OR_RAISE(auto query, ParseQuery(request.ticket));
+    ARROW_ASSIGN_OR_RAISE(auto filter, QueryFilter(query));
+    ARROW_ASSIGN_OR_RAISE(auto projection, QueryProjection(query));
 
     auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
-    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(request.ticket, arrow::io::FileMode::READ));
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(query.path, arrow::io::FileMode::READ));
     arrow::dataset::FileSource source(file);
+    std::vector<int> row_groups;
+    for (int64_t rg = query.row_group_begin; rg < query.row_group_end; rg++) {
+      row_groups.push_back(rg);
+    }
+    // an empty list of row groups scans the whole file
     ARROW_ASSIGN_OR_RAISE(
-        auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true)));
+        auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true),
+                                            nullptr, row_groups));
+    ARROW_ASSIGN_OR_RAISE(auto schema, fragment->ReadPhysicalSchema());
     
     auto options = std::make_shared<arrow::dataset::ScanOptions>();
     auto scanner_builder = std::make_shared<arrow::dataset::ScannerBuilder>(
         schema, std::move(fragment), std::move(options));
 
+    // only the projected columns are decoded and sent
     ARROW_RETURN_NOT_OK(scanner_builder->Filter(filter));
-    ARROW_RETURN_NOT_OK(scanner_builder->Project(schema->field_names()));
+    ARROW_RETURN_NOT_OK(scanner_builder->Project(
+        projection != nullptr ? projection->field_names() : schema->field_names()));
 
     ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
-    ARROW_ASSIGN_OR_RAISE(auto reader, scanner->ToRecordBatchReader());
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::RecordBatchReader> reader, scanner->ToRecordBatchReader());
+    // the stats count scanned batches, slices would count shared buffers twice
+    reader = std::make_shared<InstrumentedReader>(reader, request_id);
+    int64_t max_batch_bytes = query.max_batch_bytes > 0 ? query.max_batch_bytes : tuning_.max_batch_bytes;
+    if (max_batch_bytes > 0) {
+      reader = std::make_shared<RechunkingReader>(reader, max_batch_bytes);
+    }
 
     *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
-        new arrow::flight::RecordBatchStream(reader));
+        new arrow::flight::RecordBatchStream(
+            reader, IpcOptions(!query.compression.empty() ? query.compression : tuning_.compression)));
   
     return arrow::Status::OK();
   }
 
+  arrow::Status DoAction(const arrow::flight::ServerCallContext&,
+                         const arrow::flight::Action& action,
+                         std::unique_ptr<arrow::flight::ResultStream>* result) {
+    if (action.type == "stats") {
+      StatsWriter w;
+      w.add("active_streams", stats.active_streams.get())
+       .add("streams", stats.streams.get())
+       .add("batches_sent", stats.batches_sent.get())
+       .add("rows_sent", stats.rows_sent.get())
+       .add("bytes_sent", stats.bytes_sent.get())
+       .add("get_flight_info_us", stats.get_flight_info_us)
+       .add("do_get_us", stats.do_get_us)
+       .add("scan_batch_us", stats.scan_batch_us);
+      std::vector<arrow::flight::Result> results(1);
+      results[0].body = arrow::Buffer::FromString(w.str());
+      *result = std::unique_ptr<arrow::flight::ResultStream>(
+          new arrow::flight::SimpleResultStream(std::move(results)));
+      return arrow::Status::OK();
+    }
+#ifdef ENABLE_TRACING
+    if (action.type == "trace_events") {
+      // this server's spans, for the client to merge into its trace
+      std::vector<arrow::flight::Result> results(1);
+      results[0].body = arrow::Buffer::FromString(Tracer::Get().Events());
+      *result = std::unique_ptr<arrow::flight::ResultStream>(
+          new arrow::flight::SimpleResultStream(std::move(results)));
+      return arrow::Status::OK();
+    }
+#endif
+    return arrow::Status::NotImplemented("Unknown action ", action.type);
+  }
+
  private:
+  // Reads the footer for the schema and sizes of the projected columns and
+  // splits the row groups into query.partitions endpoints. The totals count
+  // what the endpoints scan, before the filter.
   arrow::Result<arrow::flight::FlightInfo> MakeFlightInfo(
-      const arrow::fs::FileInfo& file_info) {
-    std::shared_ptr<arrow::Schema> schema = arrow::schema({});
+      const arrow::fs::FileInfo& file_info, const FlightQuery& query) {
     std::string path = file_info.path();
     auto descriptor = arrow::flight::FlightDescriptor::Path({path});
 
-    arrow::flight::FlightEndpoint endpoint;
-    endpoint.ticket.ticket = path;
+    ARROW_ASSIGN_OR_RAISE(auto file, fs_->OpenInputFile(path));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(file, arrow::default_memory_pool(), &reader));
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+    std::shared_ptr<parquet::FileMetaData> metadata = reader->parquet_reader()->metadata();
+
+    std::vector<int> columns;
+    ARROW_ASSIGN_OR_RAISE(auto projection, QueryProjection(query));
+    if (projection != nullptr) {
+      arrow::FieldVector fields;
+      for (const auto& name : projection->field_names()) {
+        auto field = schema->GetFieldByName(name);
+        if (field == nullptr) {
+          return arrow::Status::Invalid("No column ", name, " in ", path);
+        }
+        fields.push_back(field);
+        columns.push_back(metadata->schema()->ColumnIndex(name));
+      }
+      schema = arrow::schema(fields);
+    } else {
+      for (int i = 0; i < metadata->num_columns(); i++) {
+        columns.push_back(i);
+      }
+    }
+
+    int64_t num_row_groups = metadata->num_row_groups();
+    int64_t partitions = query.partitions > 0 ? std::min(query.partitions, num_row_groups) : num_row_groups;
+    if (partitions == 0) {
+      partitions = 1;
+    }
+
     arrow::flight::Location location;
     ARROW_RETURN_NOT_OK(
         arrow::flight::Location::ForGrpcTcp(host_, port(), &location));
-    endpoint.locations.push_back(location);
 
-    return arrow::flight::FlightInfo::Make(*schema, descriptor, {endpoint}, 0, 0);
+    std::vector<arrow::flight::FlightEndpoint> endpoints;
+    int64_t total_rows = 0;
+    int64_t total_bytes = 0;
+    for (int64_t p = 0; p < partitions; p++) {
+      // the ticket repeats the query with its range, DoGet needs nothing else
+      FlightQuery range = query;
+      range.row_group_begin = p * num_row_groups / partitions;
+      range.row_group_end = num_row_groups > 0 ? (p + 1) * num_row_groups / partitions : -1;
+      for (int64_t rg = range.row_group_begin; rg < range.row_group_end; rg++) {
+        auto row_group = metadata->RowGroup(rg);
+        total_rows += row_group->num_rows();
+        for (int column : columns) {
+          if (column >= 0) {
+            total_bytes += row_group->ColumnChunk(column)->total_uncompressed_size();
+          }
+        }
+      }
+
+      arrow::flight::FlightEndpoint endpoint;
+      endpoint.ticket.ticket = SerializeQuery(range);
+      endpoint.locations.push_back(location);
+      endpoints.push_back(endpoint);
+    }
+
+    return arrow::flight::FlightInfo::Make(*schema, descriptor, endpoints, total_rows, total_bytes);
   }
 
   std::shared_ptr<arrow::fs::FileSystem> fs_;
   std::string host_;
   int32_t port_;
+  FlightTuning tuning_;
 };
 
 int main(int argc, char *argv[]) {
+  FlightTuning tuning = ParseFlightTuning(argc, argv);
+  if (argc < 2) {
+    std::cout << "./fs <port>\n" << FlightTuningUsage();
+    exit(0);
+  }
   std::string host = "10.10.1.2";
   int32_t port = (int32_t)std::stoi(argv[1]);
   auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
@@ -139,8 +326,18 @@ int main(int argc, char *argv[]) {
   arrow::flight::Location::ForGrpcTcp(host, port, &server_location);
 
   arrow::flight::FlightServerOptions options(server_location);
+  // streams flow to the client, whose channel options set the window and
+  // message limit that matter; the server keeps gRPC's defaults, which
+  // do not cap what it sends
+  if (tuning.window_bytes > 0 || tuning.max_message_bytes != -1) {
+    std::cout << "--grpc-window and --grpc-max-message only apply to fc" << std::endl;
+  }
+#ifdef ENABLE_TRACING
+  Tracer::Get().SetProcessName("fs");
+  options.middleware.push_back({"request-id", std::make_shared<RequestIdMiddlewareFactory>()});
+#endif
   auto server = std::unique_ptr<arrow::flight::FlightServerBase>(
-      new ParquetStorageService(std::move(fs), host, port));
+      new ParquetStorageService(std::move(fs), host, port, tuning));
   server->Init(options);
   std::cout << "Listening on port " << server->port() << std::endl;
   server->Serve();
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+
+#include <arrow/api.h>
+#include <arrow/flight/api.h>
+
+// Polls the "stats" action of a running fs and prints one JSON object per line.
+arrow::Status Main(int argc, char *argv[]) {
+  std::string host = argc > 2 ? argv[2] : "10.10.1.2";
+  int32_t port = (int32_t)std::stoi(argv[1]);
+  int interval_ms = argc > 3 ? atoi(argv[3]) : 1000;
+  // 0 polls until interrupted
+  int count = argc > 4 ? atoi(argv[4]) : 0;
+
+  arrow::flight::Location location;
+  ARROW_RETURN_NOT_OK(arrow::flight::Location::ForGrpcTcp(host, port, &location));
+  std::unique_ptr<arrow::flight::FlightClient> client;
+  ARROW_RETURN_NOT_OK(arrow::flight::FlightClient::Connect(location, &client));
+
+  for (int i = 0; count == 0 || i < count; i++) {
+    if (i > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+    std::unique_ptr<arrow::flight::ResultStream> results;
+    ARROW_RETURN_NOT_OK(client->DoAction({"stats", nullptr}, &results));
+    std::unique_ptr<arrow::flight::Result> result;
+    ARROW_RETURN_NOT_OK(results->Next(&result));
+    if (result == nullptr) {
+      return arrow::Status::IOError("Empty stats response");
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::cout << "{\"time_ms\": " << now << ", \"stats\": " << result->body->ToString() << "}" << std::endl;
+  }
+  return arrow::Status::OK();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cout << "./fstat <port> [host] [interval_ms] [count]\n";
+    exit(0);
+  }
+  arrow::Status s = Main(argc, argv);
+  if (!s.ok()) {
+    std::cerr << s.ToString() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include <arrow/api.h>
+#include <arrow/flight/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/compression.h>
+
+
+// How Flight streams are encoded and carried, set with --name=value flags
+// on both fs and fc. The client sends its codec and batch size with every
+// query; the server's own values apply to queries that leave them unset.
+struct FlightTuning {
+  // IPC body codec: "lz4" (LZ4_FRAME) or "zstd", empty for none
+  std::string compression;
+  // batches above this many bytes are sliced before they are sent, 0 sends
+  // them as scanned
+  int64_t max_batch_bytes = 0;
+  // fixed HTTP/2 flow-control window in bytes, 0 leaves gRPC's bandwidth
+  // probing in charge
+  int window_bytes = 0;
+  // gRPC message size limit in bytes, -1 for no limit, 0 for gRPC's default
+  int max_message_bytes = -1;
+};
+
+// Takes the tuning flags out of argv, leaving the rest for the caller.
+inline FlightTuning ParseFlightTuning(int &argc, char **argv) {
+  FlightTuning tuning;
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    std::string name = arg.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    if (name == "--compression") {
+      tuning.compression = value;
+    } else if (name == "--max-batch-bytes") {
+      tuning.max_batch_bytes = std::stoll(value);
+    } else if (name == "--grpc-window") {
+      tuning.window_bytes = std::stoi(value);
+    } else if (name == "--grpc-max-message") {
+      tuning.max_message_bytes = std::stoi(value);
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argc = kept;
+  return tuning;
+}
+
+inline std::string FlightTuningUsage() {
+  return "  [--compression=lz4|zstd] [--max-batch-bytes=N] [--grpc-window=N] [--grpc-max-message=N]\n";
+}
+
+// IPC options for `compression`; IPC bodies support only LZ4_FRAME and
+// ZSTD, anything else falls back to none like the thallium server does
+inline arrow::ipc::IpcWriteOptions IpcOptions(const std::string &compression) {
+  auto options = arrow::ipc::IpcWriteOptions::Defaults();
+  if (compression.empty()) {
+    return options;
+  }
+  auto codec_type = arrow::util::Codec::GetCompressionType(compression);
+  if (!codec_type.ok() || !arrow::util::Codec::IsAvailable(*codec_type) ||
+      (*codec_type != arrow::Compression::LZ4_FRAME && *codec_type != arrow::Compression::ZSTD)) {
+    std::cerr << "Unsupported IPC compression " << compression << ", sending uncompressed" << std::endl;
+    return options;
+  }
+  options.codec = arrow::util::Codec::Create(*codec_type).ValueOrDie();
+  return options;
+}
+
+// gRPC channel arguments for the client side of `tuning`
+inline void SetChannelOptions(const FlightTuning &tuning, arrow::flight::FlightClientOptions &options) {
+  if (tuning.window_bytes > 0) {
+    options.generic_options.emplace_back("grpc.http2.lookahead_bytes", tuning.window_bytes);
+    options.generic_options.emplace_back("grpc.http2.bdp_probe", 0);
+  }
+  if (tuning.max_message_bytes != 0) {
+    options.generic_options.emplace_back("grpc.max_receive_message_length", tuning.max_message_bytes);
+    options.generic_options.emplace_back("grpc.max_send_message_length", tuning.max_message_bytes);
+  }
+}
+
+// Slices the batches of a reader to at most max_bytes each, splitting by
+// rows in proportion to the batch's size. Slices share the scanned buffers.
+class RechunkingReader : public arrow::RecordBatchReader {
+ public:
+  RechunkingReader(std::shared_ptr<arrow::RecordBatchReader> reader, int64_t max_bytes)
+      : reader_(std::move(reader)), max_bytes_(max_bytes) {}
+
+  std::shared_ptr<arrow::Schema> schema() const override { return reader_->schema(); }
+
+  arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch>* batch) override {
+    if (pending_ == nullptr || offset_ >= pending_->num_rows()) {
+      ARROW_RETURN_NOT_OK(reader_->ReadNext(&pending_));
+      offset_ = 0;
+      if (pending_ == nullptr) {
+        *batch = nullptr;
+        return arrow::Status::OK();
+      }
+      int64_t bytes = arrow::util::TotalBufferSize(*pending_);
+      rows_per_chunk_ = pending_->num_rows();
+      if (bytes > max_bytes_ && pending_->num_rows() > 1) {
+        rows_per_chunk_ = std::max<int64_t>(1, pending_->num_rows() * max_bytes_ / bytes);
+      }
+    }
+    if (offset_ == 0 && rows_per_chunk_ >= pending_->num_rows()) {
+      *batch = pending_;
+    } else {
+      *batch = pending_->Slice(offset_, rows_per_chunk_);
+    }
+    offset_ += rows_per_chunk_;
+    return arrow::Status::OK();
+  }
+
+ private:
+  std::shared_ptr<arrow::RecordBatchReader> reader_;
+  int64_t max_bytes_;
+  std::shared_ptr<arrow::RecordBatch> pending_;
+  int64_t offset_ = 0;
+  int64_t rows_per_chunk_ = 0;
+};
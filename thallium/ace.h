@@ -1,12 +1,19 @@
+#pragma once
+
 #include <iostream>
 #include <memory>
 #include <utility>
 #include <vector>
+#include <algorithm>
+
+#include <glob.h>
 
 #include <arrow/api.h>
 #include <arrow/csv/api.h>
 #include <arrow/dataset/api.h>
+#include <arrow/dataset/file_parquet.h>
 #include <arrow/io/api.h>
+#include <arrow/io/caching.h>
 #include <arrow/ipc/api.h>
 #include <arrow/compute/api.h>
 #include <arrow/compute/api_vector.h>
@@ -14,155 +21,90 @@
 #include <arrow/compute/exec/exec_plan.h>
 #include <arrow/compute/exec/expression.h>
 #include <arrow/filesystem/filesystem.h>
+#include <arrow/filesystem/localfs.h>
 #include <arrow/filesystem/path_util.h>
 #include <arrow/util/future.h>
 #include <arrow/util/range.h>
 #include <arrow/util/thread_pool.h>
 #include <arrow/util/vector.h>
+#include <parquet/properties.h>
 
 #include "payload.h"
+#ifdef HAVE_URING
+#include "uring_file.h"
+#endif
+#include "metadata_cache.h"
+#include "resident.h"
+#include "stats_index.h"
 
 
 namespace cp = arrow::compute;
 
 
-class RandomAccessObject : public arrow::io::RandomAccessFile {
- public:
-  explicit RandomAccessObject(uint8_t *ptr, int64_t size) {
-    file_ptr = ptr;
-    file_size = size;
-  }
-
-  ~RandomAccessObject() override { DCHECK_OK(Close()); }
-
-  arrow::Status CheckClosed() const {
-    if (closed_) {
-      return arrow::Status::Invalid("Operation on closed stream");
+// The files a scan request covers: its explicit list of paths, or every
+// file under `path` if it is a directory, or the matches of `path` if it is
+// a glob pattern, or just `path`.
+arrow::Result<std::vector<std::string>> ResolvePaths(const ScanReqRPCStub& stub) {
+    if (!stub.paths.empty()) {
+        return stub.paths;
     }
-    return arrow::Status::OK();
-  }
 
-  arrow::Status CheckPosition(int64_t position, const char* action) const {
-    if (position < 0) {
-      return arrow::Status::Invalid("Cannot ", action, " from negative position");
-    }
-    if (position > file_size) {
-      return arrow::Status::IOError("Cannot ", action, " past end of file");
+    std::vector<std::string> paths;
+    if (stub.path.find_first_of("*?[") != std::string::npos) {
+        glob_t matches;
+        int ret = glob(stub.path.c_str(), 0, NULL, &matches);
+        if (ret == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) {
+                paths.push_back(matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+        if (ret != 0 && ret != GLOB_NOMATCH) {
+            return arrow::Status::IOError("Cannot expand ", stub.path);
+        }
+        return paths;
     }
-    return arrow::Status::OK();
-  }
 
-  arrow::Result<int64_t> ReadAt(int64_t position, int64_t nbytes, void* out) override {
-    return arrow::Status::NotImplemented(
-        "ReadAt has not been implemented in RandomAccessObject");
-  }
-
-  arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(int64_t position,
-                                                       int64_t nbytes) override {
-    RETURN_NOT_OK(CheckClosed());
-    RETURN_NOT_OK(CheckPosition(position, "read"));
-
-    nbytes = std::min(nbytes, file_size - position);
-
-    if (nbytes > 0) {
-        return std::make_shared<arrow::Buffer>(file_ptr + position, nbytes);
+    arrow::fs::LocalFileSystem fs;
+    ARROW_ASSIGN_OR_RAISE(auto info, fs.GetFileInfo(stub.path));
+    if (info.IsDirectory()) {
+        arrow::fs::FileSelector s;
+        s.base_dir = stub.path;
+        s.recursive = true;
+        ARROW_ASSIGN_OR_RAISE(auto infos, fs.GetFileInfo(s));
+        for (const auto &file_info : infos) {
+            if (file_info.IsFile()) {
+                paths.push_back(file_info.path());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        return paths;
     }
-    return std::make_shared<arrow::Buffer>("");
-  }
-
-  arrow::Result<std::shared_ptr<arrow::Buffer>> Read(int64_t nbytes) override {
-    ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(pos_, nbytes));
-    pos_ += buffer->size();
-    return std::move(buffer);
-  }
-
-  arrow::Result<int64_t> Read(int64_t nbytes, void* out) override {
-    ARROW_ASSIGN_OR_RAISE(int64_t bytes_read, ReadAt(pos_, nbytes, out));
-    pos_ += bytes_read;
-    return bytes_read;
-  }
-
-  arrow::Result<int64_t> GetSize() override {
-    RETURN_NOT_OK(CheckClosed());
-    return file_size;
-  }
-
-  arrow::Status Seek(int64_t position) override {
-    RETURN_NOT_OK(CheckClosed());
-    RETURN_NOT_OK(CheckPosition(position, "seek"));
-
-    pos_ = position;
-    return arrow::Status::OK();
-  }
-
-  arrow::Result<int64_t> Tell() const override {
-    RETURN_NOT_OK(CheckClosed());
-    return pos_;
-  }
-
-  arrow::Status Close() override {
-    closed_ = true;
-    return arrow::Status::OK();
-  }
-
-  bool closed() const override { return closed_; }
-
- private:
-  bool closed_ = false;
-  int64_t pos_ = 0;
-  uint8_t *file_ptr = NULL;
-  int64_t file_size = -1;
-};
-
-
-arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanBenchmark(cp::ExecContext& exec_context, const ScanReqRPCStub& stub) {
-    std::string uri = "file:///mnt/cephfs/dataset";
-    
-    std::string path;
-    ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &path)); 
-    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
-      
-    arrow::fs::FileSelector s;
-    s.base_dir = std::move(path);
-    s.recursive = true;
-
-    auto filter = 
-        arrow::compute::greater(arrow::compute::field_ref("total_amount"),
-                                arrow::compute::literal(-200));
 
-    arrow::dataset::FileSystemFactoryOptions options;
-    ARROW_ASSIGN_OR_RAISE(auto factory, 
-      arrow::dataset::FileSystemDatasetFactory::Make(std::move(fs), s, std::move(format), options));
-    arrow::dataset::FinishOptions finish_options;
-    ARROW_ASSIGN_OR_RAISE(auto dataset,factory->Finish(finish_options));
-
-    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<cp::ExecPlan> plan,
-                          cp::ExecPlan::Make(&exec_context));
-
-    ARROW_ASSIGN_OR_RAISE(auto scanner_builder, dataset->NewScan());
-    ARROW_RETURN_NOT_OK(scanner_builder->Filter(filter));
-    ARROW_RETURN_NOT_OK(scanner_builder->Project({"passenger_count", "fare_amount"}));
-
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
-    ARROW_ASSIGN_OR_RAISE(auto table, scanner->ToTable());
+    paths.push_back(stub.path);
+    return paths;
+}
 
-    auto im_ds = std::make_shared<arrow::dataset::InMemoryDataset>(table);
-    ARROW_ASSIGN_OR_RAISE(auto im_ds_scanner_builder, im_ds->NewScan());
-    ARROW_ASSIGN_OR_RAISE(auto im_ds_scanner, im_ds_scanner_builder->Finish());
-    ARROW_ASSIGN_OR_RAISE(auto reader, im_ds_scanner->ToRecordBatchReader());
 
-    return reader;
+// Columns declared as dictionaries in the dataset schema are read from
+// Parquet as dictionaries, so they stay encoded all the way to the client.
+void SetDictColumns(arrow::dataset::ParquetFileFormat &format, const arrow::Schema &dataset_schema) {
+    for (const auto &field : dataset_schema.fields()) {
+        if (field->type()->id() == arrow::Type::DICTIONARY) {
+            format.reader_options.dict_columns.insert(field->name());
+        }
+    }
 }
 
 
-arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4(const ScanReqRPCStub& stub) {   
-    // deserialize filter
+// Scans a resident file with the stub's filter and projection, without
+// touching storage.
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanResident(ResidentDataset &dataset,
+                                                                      const ScanReqRPCStub& stub) {
     ARROW_ASSIGN_OR_RAISE(auto filter,
       arrow::compute::Deserialize(std::make_shared<arrow::Buffer>(
       stub.filter_buffer, stub.filter_buffer_size))
     );
-
-    // deserialize schemas
     arrow::ipc::DictionaryMemo empty_memo;
     arrow::io::BufferReader projection_schema_reader(stub.projection_schema_buffer,
                                                      stub.projection_schema_buffer_size);
@@ -170,20 +112,12 @@ arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4(const ScanReqR
                                                   stub.dataset_schema_buffer_size);
     ARROW_ASSIGN_OR_RAISE(auto projection_schema,
                           arrow::ipc::ReadSchema(&projection_schema_reader, &empty_memo));
-
     ARROW_ASSIGN_OR_RAISE(auto dataset_schema,
                           arrow::ipc::ReadSchema(&dataset_schema_reader, &empty_memo));
 
-    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
-    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::ReadableFile::Open(stub.path));
-    arrow::dataset::FileSource source(file);
-    ARROW_ASSIGN_OR_RAISE(
-        auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true)));
-    
-    auto options = std::make_shared<arrow::dataset::ScanOptions>();
-    auto scanner_builder = std::make_shared<arrow::dataset::ScannerBuilder>(
-        dataset_schema, std::move(fragment), std::move(options));
-
+    ARROW_ASSIGN_OR_RAISE(auto table, dataset.Get(stub.path, *dataset_schema));
+    auto im_ds = std::make_shared<arrow::dataset::InMemoryDataset>(table);
+    ARROW_ASSIGN_OR_RAISE(auto scanner_builder, im_ds->NewScan());
     ARROW_RETURN_NOT_OK(scanner_builder->Filter(filter));
     ARROW_RETURN_NOT_OK(scanner_builder->Project(projection_schema->field_names()));
 
@@ -193,45 +127,56 @@ arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4(const ScanReqR
 }
 
 
-arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4MMap(const ScanReqRPCStub& stub) {   
-    // deserialize filter
+// The row groups of a file that may hold rows passing the stub's filter,
+// given its statistics; empty if the whole file can be skipped.
+arrow::Result<std::vector<int>> MatchingRowGroups(const FileStats &stats, const ScanReqRPCStub& stub) {
     ARROW_ASSIGN_OR_RAISE(auto filter,
       arrow::compute::Deserialize(std::make_shared<arrow::Buffer>(
       stub.filter_buffer, stub.filter_buffer_size))
     );
-
-    // deserialize schemas
     arrow::ipc::DictionaryMemo empty_memo;
-    arrow::io::BufferReader projection_schema_reader(stub.projection_schema_buffer,
-                                                     stub.projection_schema_buffer_size);
     arrow::io::BufferReader dataset_schema_reader(stub.dataset_schema_buffer,
                                                   stub.dataset_schema_buffer_size);
-    ARROW_ASSIGN_OR_RAISE(auto projection_schema,
-                          arrow::ipc::ReadSchema(&projection_schema_reader, &empty_memo));
-
     ARROW_ASSIGN_OR_RAISE(auto dataset_schema,
                           arrow::ipc::ReadSchema(&dataset_schema_reader, &empty_memo));
 
-    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
-    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(stub.path, arrow::io::FileMode::READ));
-    arrow::dataset::FileSource source(file);
-    ARROW_ASSIGN_OR_RAISE(
-        auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true)));
-    
-    auto options = std::make_shared<arrow::dataset::ScanOptions>();
-    auto scanner_builder = std::make_shared<arrow::dataset::ScannerBuilder>(
-        dataset_schema, std::move(fragment), std::move(options));
+    // the filter is bound once; one that does not bind skips nothing
+    std::vector<int> row_groups;
+    auto bound_filter = filter.Bind(*dataset_schema);
+    if (bound_filter.ok() && !MayMatch(stats.file, *bound_filter, *dataset_schema)) {
+        return row_groups;
+    }
+    for (int i = 0; i < (int)stats.row_groups.size(); i++) {
+        if (!bound_filter.ok() || MayMatch(stats.row_groups[i], *bound_filter, *dataset_schema)) {
+            row_groups.push_back(i);
+        }
+    }
+    return row_groups;
+}
 
-    ARROW_RETURN_NOT_OK(scanner_builder->Filter(filter));
-    ARROW_RETURN_NOT_OK(scanner_builder->Project(projection_schema->field_names()));
 
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
-    ARROW_ASSIGN_OR_RAISE(auto reader, scanner->ToRecordBatchReader());
-    return reader;
+// what a scan of a skipped file returns: no batches, in the projected schema
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> EmptyScan(const ScanReqRPCStub& stub) {
+    arrow::ipc::DictionaryMemo empty_memo;
+    arrow::io::BufferReader projection_schema_reader(stub.projection_schema_buffer,
+                                                     stub.projection_schema_buffer_size);
+    ARROW_ASSIGN_OR_RAISE(auto projection_schema,
+                          arrow::ipc::ReadSchema(&projection_schema_reader, &empty_memo));
+    return arrow::RecordBatchReader::Make({}, projection_schema);
 }
 
 
-arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanBake(const ScanReqRPCStub& stub, uint8_t *ptr) {   
+// Scans one Parquet file with the stub's filter and projection, limited to
+// `row_groups` unless that is empty. With pre_buffer, the column chunks of
+// each row group are fetched up front as a few large, coalesced reads issued
+// through the file's ReadAsync. With a cache and the file's cache_id, the
+// fragment takes its footer from the cache instead of reading and parsing it.
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanParquet(const ScanReqRPCStub& stub,
+                                                                     std::shared_ptr<arrow::io::RandomAccessFile> file,
+                                                                     bool pre_buffer = false,
+                                                                     MetadataCache *cache = nullptr,
+                                                                     const std::string &cache_id = "",
+                                                                     std::vector<int> row_groups = {}) {
     // deserialize filter
     ARROW_ASSIGN_OR_RAISE(auto filter,
       arrow::compute::Deserialize(std::make_shared<arrow::Buffer>(
@@ -250,13 +195,39 @@ arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanBake(const ScanReqR
     ARROW_ASSIGN_OR_RAISE(auto dataset_schema,
                           arrow::ipc::ReadSchema(&dataset_schema_reader, &empty_memo));
 
-    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
-    auto file = std::make_shared<RandomAccessObject>(ptr, 16074327);
-    arrow::dataset::FileSource source(file);
-    ARROW_ASSIGN_OR_RAISE(
-        auto fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true)));
-    
     auto options = std::make_shared<arrow::dataset::ScanOptions>();
+    if (pre_buffer) {
+        auto parquet_options = std::make_shared<arrow::dataset::ParquetFragmentScanOptions>();
+        parquet_options->arrow_reader_properties->set_pre_buffer(true);
+        parquet_options->arrow_reader_properties->set_cache_options(arrow::io::CacheOptions::Defaults());
+        options->fragment_scan_options = parquet_options;
+    }
+
+    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+    SetDictColumns(*format, *dataset_schema);
+    arrow::dataset::FileSource source(std::move(file));
+    std::shared_ptr<arrow::dataset::ParquetFileFragment> fragment;
+    if (cache != nullptr && cache->enabled() && !cache_id.empty()) {
+        // the inferred schema depends on which columns are read as dictionaries
+        std::string key = cache_id;
+        for (const auto &column : format->reader_options.dict_columns) {
+            key += "|" + column;
+        }
+        ARROW_ASSIGN_OR_RAISE(auto metadata, cache->GetOrOpen(key, [&]() {
+            return format->GetReader(source);
+        }));
+        ARROW_ASSIGN_OR_RAISE(
+            fragment, format->MakeFragment(source, arrow::compute::literal(true), metadata.schema,
+                                           std::move(row_groups)));
+        // built over the cached footer, and dropped once the fragment has it
+        ARROW_ASSIGN_OR_RAISE(auto footer_reader, format->GetReader(source, options, metadata.metadata));
+        ARROW_RETURN_NOT_OK(fragment->EnsureCompleteMetadata(footer_reader.get()));
+    } else {
+        ARROW_ASSIGN_OR_RAISE(
+            fragment, format->MakeFragment(std::move(source), arrow::compute::literal(true), nullptr,
+                                           std::move(row_groups)));
+    }
+
     auto scanner_builder = std::make_shared<arrow::dataset::ScannerBuilder>(
         dataset_schema, std::move(fragment), std::move(options));
 
@@ -267,3 +238,42 @@ arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanBake(const ScanReqR
     ARROW_ASSIGN_OR_RAISE(auto reader, scanner->ToRecordBatchReader());
     return reader;
 }
+
+
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4(const ScanReqRPCStub& stub,
+                                                                  MetadataCache *cache = nullptr) {
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::ReadableFile::Open(stub.path));
+    ARROW_ASSIGN_OR_RAISE(auto cache_id, FileCacheId(stub.path));
+    return ScanParquet(stub, file, false, cache, cache_id);
+}
+
+
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4MMap(const ScanReqRPCStub& stub,
+                                                                      MetadataCache *cache = nullptr) {
+    ARROW_ASSIGN_OR_RAISE(auto file, arrow::io::MemoryMappedFile::Open(stub.path, arrow::io::FileMode::READ));
+    ARROW_ASSIGN_OR_RAISE(auto cache_id, FileCacheId(stub.path));
+    return ScanParquet(stub, file, false, cache, cache_id);
+}
+
+
+#ifdef HAVE_URING
+// reads through io_uring, optionally bypassing the page cache, with the
+// column chunks of each row group pre-buffered
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanEXT4Uring(const ScanReqRPCStub& stub, bool direct,
+                                                                       MetadataCache *cache = nullptr) {
+    ARROW_ASSIGN_OR_RAISE(auto file, UringFile::Open(stub.path, direct));
+    ARROW_ASSIGN_OR_RAISE(auto cache_id, FileCacheId(stub.path));
+    return ScanParquet(stub, file, true, cache, cache_id);
+}
+#endif
+
+
+// bake regions are immutable, so the region ID alone names a version
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanBake(const ScanReqRPCStub& stub,
+                                                                  std::shared_ptr<arrow::io::RandomAccessFile> file,
+                                                                  const std::string &region_id = "",
+                                                                  MetadataCache *cache = nullptr,
+                                                                  std::vector<int> row_groups = {}) {
+    return ScanParquet(stub, std::move(file), false, cache, region_id.empty() ? "" : "bake:" + region_id,
+                       std::move(row_groups));
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+
+#include <arrow/buffer.h>
+#include <arrow/io/interfaces.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+
+#include <bake-client.hpp>
+
+
+// A bake region read on demand: every ReadAt is one bake read of just the
+// requested range, so Parquet fetches the footer and the projected column
+// chunks and nothing else. ReadAsync keeps RandomAccessFile's default, which
+// runs ReadAt on Arrow's IO pool.
+class BakeRegionFile : public arrow::io::RandomAccessFile {
+    private:
+        const bake::client &client;
+        const bake::provider_handle &provider;
+        bake::target target;
+        bake::region region;
+        int64_t size;
+        int64_t pos = 0;
+        bool is_closed = false;
+
+        BakeRegionFile(const bake::client &client, const bake::provider_handle &provider,
+                       const bake::target &target, const bake::region &region, int64_t size)
+            : client(client), provider(provider), target(target), region(region), size(size) {}
+
+        arrow::Status CheckOpen() const {
+            if (is_closed) {
+                return arrow::Status::Invalid("Operation on closed bake region");
+            }
+            return arrow::Status::OK();
+        }
+
+    public:
+        // asks bake for the size of the region
+        static arrow::Result<std::shared_ptr<BakeRegionFile>> Open(
+                const bake::client &client, const bake::provider_handle &provider,
+                const bake::target &target, const bake::region &region) {
+            try {
+                int64_t size = client.get_size(provider, target, region);
+                return std::shared_ptr<BakeRegionFile>(
+                    new BakeRegionFile(client, provider, target, region, size));
+            } catch (const std::exception &e) {
+                return arrow::Status::IOError("bake get_size: ", e.what());
+            }
+        }
+
+        arrow::Result<int64_t> ReadAt(int64_t position, int64_t nbytes, void* out) override {
+            RETURN_NOT_OK(CheckOpen());
+            if (position < 0 || position > size) {
+                return arrow::Status::IOError("Read at ", position, " outside bake region of ", size, " bytes");
+            }
+            nbytes = std::min(nbytes, size - position);
+            if (nbytes <= 0) {
+                return 0;
+            }
+            try {
+                return (int64_t)client.read(provider, target, region, position, out, nbytes);
+            } catch (const std::exception &e) {
+                return arrow::Status::IOError("bake read: ", e.what());
+            }
+        }
+
+        arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(int64_t position, int64_t nbytes) override {
+            nbytes = std::max<int64_t>(0, std::min(nbytes, size - position));
+            ARROW_ASSIGN_OR_RAISE(auto buffer, arrow::AllocateResizableBuffer(nbytes));
+            ARROW_ASSIGN_OR_RAISE(int64_t bytes_read, ReadAt(position, nbytes, buffer->mutable_data()));
+            if (bytes_read < nbytes) {
+                RETURN_NOT_OK(buffer->Resize(bytes_read));
+            }
+            return std::shared_ptr<arrow::Buffer>(std::move(buffer));
+        }
+
+        arrow::Result<int64_t> Read(int64_t nbytes, void* out) override {
+            ARROW_ASSIGN_OR_RAISE(int64_t bytes_read, ReadAt(pos, nbytes, out));
+            pos += bytes_read;
+            return bytes_read;
+        }
+
+        arrow::Result<std::shared_ptr<arrow::Buffer>> Read(int64_t nbytes) override {
+            ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(pos, nbytes));
+            pos += buffer->size();
+            return buffer;
+        }
+
+        arrow::Result<int64_t> GetSize() override {
+            RETURN_NOT_OK(CheckOpen());
+            return size;
+        }
+
+        arrow::Status Seek(int64_t position) override {
+            RETURN_NOT_OK(CheckOpen());
+            if (position < 0 || position > size) {
+                return arrow::Status::IOError("Seek to ", position, " outside bake region of ", size, " bytes");
+            }
+            pos = position;
+            return arrow::Status::OK();
+        }
+
+        arrow::Result<int64_t> Tell() const override {
+            RETURN_NOT_OK(CheckOpen());
+            return pos;
+        }
+
+        arrow::Status Close() override {
+            is_closed = true;
+            return arrow::Status::OK();
+        }
+
+        bool closed() const override { return is_closed; }
+};
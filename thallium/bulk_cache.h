@@ -0,0 +1,123 @@
+#pragma once
+
+#include <iterator>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <arrow/buffer.h>
+
+#include <thallium.hpp>
+
+
+// The allocation a (possibly sliced) buffer points into.
+inline std::shared_ptr<arrow::Buffer> RootOf(std::shared_ptr<arrow::Buffer> buff) {
+    while (buff->parent() != nullptr) {
+        buff = buff->parent();
+    }
+    return buff;
+}
+
+// Bulk handles for long-lived root buffers, so memory that is sent over and
+// over is only registered once. Entries only hold weak references; an entry
+// whose buffer has been freed is dropped (and deregistered) on the next miss
+// or sweep, and never handed out again. Past `capacity` registered bytes the
+// least recently used entries are dropped too; transfers still using one
+// keep their own reference to its handle.
+class bulk_cache {
+    private:
+        struct entry {
+            std::weak_ptr<arrow::Buffer> owner;
+            int64_t size;
+            thallium::bulk bulk;
+            std::list<const uint8_t*>::iterator lru_it;
+        };
+
+        thallium::engine engine;
+        int64_t capacity;
+        std::unordered_map<const uint8_t*, entry> entries;
+        // most recently used first
+        std::list<const uint8_t*> lru;
+        thallium::mutex m;
+        int64_t registered_bytes = 0;
+
+        void erase_locked(std::unordered_map<const uint8_t*, entry>::iterator it) {
+            registered_bytes -= it->second.size;
+            lru.erase(it->second.lru_it);
+            entries.erase(it);
+        }
+
+        void sweep_locked() {
+            for (auto it = entries.begin(); it != entries.end();) {
+                auto next = std::next(it);
+                if (it->second.owner.expired()) {
+                    erase_locked(it);
+                }
+                it = next;
+            }
+        }
+
+    public:
+        // 0 for no bound
+        explicit bulk_cache(thallium::engine engine, int64_t capacity = 0) : engine(engine), capacity(capacity) {}
+
+        thallium::bulk get(const std::shared_ptr<arrow::Buffer> &root) {
+            std::lock_guard<thallium::mutex> lock(m);
+            auto it = entries.find(root->data());
+            if (it != entries.end()) {
+                if (it->second.owner.lock() == root && it->second.size == root->size()) {
+                    lru.splice(lru.begin(), lru, it->second.lru_it);
+                    return it->second.bulk;
+                }
+                erase_locked(it);
+            }
+            sweep_locked();
+
+            std::vector<std::pair<void*,std::size_t>> segments(1);
+            segments[0].first = (void*)root->data();
+            segments[0].second = root->size();
+            entry e;
+            e.owner = root;
+            e.size = root->size();
+            e.bulk = engine.expose(segments, thallium::bulk_mode::read_only);
+            lru.push_front(root->data());
+            e.lru_it = lru.begin();
+            registered_bytes += e.size;
+            entries[root->data()] = e;
+            while (capacity > 0 && registered_bytes > capacity && lru.size() > 1) {
+                erase_locked(entries.find(lru.back()));
+            }
+            return e.bulk;
+        }
+
+        void invalidate(const uint8_t *base) {
+            std::lock_guard<thallium::mutex> lock(m);
+            auto it = entries.find(base);
+            if (it != entries.end()) {
+                erase_locked(it);
+            }
+        }
+
+        void sweep() {
+            std::lock_guard<thallium::mutex> lock(m);
+            sweep_locked();
+        }
+
+        void clear() {
+            std::lock_guard<thallium::mutex> lock(m);
+            entries.clear();
+            lru.clear();
+            registered_bytes = 0;
+        }
+
+        size_t size() {
+            std::lock_guard<thallium::mutex> lock(m);
+            return entries.size();
+        }
+
+        int64_t bytes() {
+            std::lock_guard<thallium::mutex> lock(m);
+            return registered_bytes;
+        }
+};
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <unordered_map>
 
 #include <arrow/api.h>
 #include <arrow/compute/exec/expression.h>
@@ -10,6 +11,8 @@
 #include <arrow/ipc/api.h>
 #include <arrow/util/checked_cast.h>
 #include <arrow/util/iterator.h>
+#include <arrow/util/compression.h>
+#include <arrow/util/parallel.h>
 #include "arrow/array/array_base.h"
 #include "arrow/array/array_nested.h"
 #include "arrow/array/data.h"
@@ -22,24 +25,8 @@
 #include <thallium.hpp>
 
 #include "payload.h"
-
-
-class MeasureExecutionTime{
-  private:
-      const std::chrono::steady_clock::time_point begin;
-      const std::string caller;
-  public:
-      MeasureExecutionTime(const std::string& caller):caller(caller),begin(std::chrono::steady_clock::now()){}
-      ~MeasureExecutionTime(){
-          const auto duration=std::chrono::steady_clock::now()-begin;
-          std::cout << (double)std::chrono::duration_cast<std::chrono::milliseconds>(duration).count()/1000<<std::endl;
-      }
-};
-
-
-#ifndef MEASURE_FUNCTION_EXECUTION_TIME
-#define MEASURE_FUNCTION_EXECUTION_TIME const MeasureExecutionTime measureExecutionTime(__FUNCTION__);
-#endif
+#include "benchmark.h"
+#include "trace.h"
 
 
 namespace tl = thallium;
@@ -62,139 +49,295 @@ arrow::Result<ScanReq> GetScanRequest(std::string path,
     ScanReq req;
     req.stub = stub;
     req.schema = projection_schema;
+    req.buffers = {filter_buff, projection_schema_buff, dataset_schema_buff};
     return req;
 }
 
-ConnCtx Init(std::string host) {
+ConnCtx Init(std::string host, int64_t pool_size) {
     ConnCtx ctx;
-    tl::engine engine("verbs://ibp130s0", THALLIUM_SERVER_MODE, true);
+    tl::engine engine(ListenAddress(host), THALLIUM_SERVER_MODE, true);
     tl::endpoint endpoint = engine.lookup(host);
     ctx.engine = engine;
     ctx.endpoint = endpoint;
-    tl::remote_procedure clear = engine.define("clear");
-    clear.on(endpoint)();
+    ctx.pool = std::make_shared<SlabMemoryPool>(ctx.engine, pool_size, tl::bulk_mode::write_only);
     return ctx;
 }
 
-void Scan(ConnCtx &conn_ctx, ScanReq &scan_req) {
+ScanCtx Scan(ConnCtx &conn_ctx, ScanReq &scan_req) {
     tl::remote_procedure scan = conn_ctx.engine.define("scan");
-    scan.disable_response();
     ScanCtx scan_ctx;
-    scan.on(conn_ctx.endpoint)(scan_req.stub);
+    scan_ctx.uuid = scan.on(conn_ctx.endpoint)(scan_req.stub).as<std::string>();
+    scan_ctx.schema = scan_req.schema;
+    return scan_ctx;
 }
 
-arrow::Result<std::shared_ptr<arrow::RecordBatch>> GetNextBatch(ConnCtx &conn_ctx, std::shared_ptr<arrow::Schema> schema, bool last) {
-    std::shared_ptr<arrow::RecordBatch> batch;
-    std::function<void(const tl::request&, int64_t&, std::vector<int64_t>&, std::vector<int64_t>&, tl::bulk&)> f =
-        [&conn_ctx, &schema, &batch, &last](const tl::request& req, int64_t& num_rows, std::vector<int64_t>& data_buff_sizes, std::vector<int64_t>& offset_buff_sizes, tl::bulk& b) {
-            int num_cols = schema->num_fields();
-            
-            std::vector<std::shared_ptr<arrow::Array>> columns;
-            std::vector<std::unique_ptr<arrow::Buffer>> data_buffs(num_cols);
-            std::vector<std::unique_ptr<arrow::Buffer>> offset_buffs(num_cols);
-            std::vector<std::pair<void*,std::size_t>> segments(num_cols*2);
-            
-            for (int64_t i = 0; i < num_cols; i++) {
-                data_buffs[i] = arrow::AllocateBuffer(data_buff_sizes[i]).ValueOrDie();
-                offset_buffs[i] = arrow::AllocateBuffer(offset_buff_sizes[i]).ValueOrDie();
-
-                segments[i*2].first = (void*)data_buffs[i]->mutable_data();
-                segments[i*2].second = data_buff_sizes[i];
-
-                segments[(i*2)+1].first = (void*)offset_buffs[i]->mutable_data();
-                segments[(i*2)+1].second = offset_buff_sizes[i];
+void Clear(ConnCtx &conn_ctx, ScanCtx &scan_ctx) {
+    tl::remote_procedure clear = conn_ctx.engine.define("clear");
+    clear.on(conn_ctx.endpoint)(scan_ctx.uuid);
+}
+
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> GetNextBatch(ConnCtx &conn_ctx, ScanCtx &scan_ctx, 
+                                                                             size_t max_batches, int64_t max_bytes) {
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    std::shared_ptr<arrow::Schema> schema = scan_ctx.schema;
+    // tags the spans of this call on both sides
+    uint64_t request_id = NextRequestId();
+    TRACE_SPAN("get_next_batch", request_id);
+    // why do_rdma could not take the batches, if it could not
+    arrow::Status rdma_status;
+    std::function<void(const tl::request&, std::vector<BatchDesc>&, std::vector<TransferChunk>&, std::vector<tl::bulk>&)> f =
+        [&conn_ctx, &schema, &batches, &rdma_status, request_id](const tl::request& req, std::vector<BatchDesc>& descs, std::vector<TransferChunk>& chunks, std::vector<tl::bulk>& bulks) {
+            int64_t begin = TRACE_NOW();
+            auto fail = [&](const arrow::Status &status) {
+                rdma_status = status;
+                return req.respond(kTransferFailed);
+            };
+            // all the batches land in one region, laid out like the server's segments
+            auto padded_array_size = [](const ArrayDesc &array) {
+                int64_t size = 0;
+                for (size_t i = 0; i < array.buffer_sizes.size(); i++) {
+                    size += array.buffer_sizes[i] > 0 ? PaddedSize(array.wire_size(i)) : 0;
+                }
+                return size;
+            };
+            int64_t total_size = 0;
+            for (const auto &desc : descs) {
+                for (size_t i = 0; i < desc.columns.size(); i++) {
+                    total_size += padded_array_size(desc.columns[i]) + padded_array_size(desc.dictionaries[i]);
+                }
+            }
+            // the region goes back to the pool once every batch sliced from it is dropped
+            auto allocated = arrow::AllocateBuffer(total_size, conn_ctx.pool.get());
+            if (!allocated.ok()) {
+                return fail(allocated.status());
+            }
+            std::shared_ptr<arrow::Buffer> region = std::move(*allocated);
+
+            tl::bulk local;
+            int64_t local_base = 0;
+            if (conn_ctx.pool->Contains(region->data())) {
+                local = conn_ctx.pool->bulk();
+                local_base = conn_ctx.pool->Offset(region->data());
+            } else {
+                // the slab is exhausted, register this region on its own
+                std::vector<std::pair<void*,std::size_t>> segments(1);
+                segments[0].first = (void*)region->mutable_data();
+                segments[0].second = total_size;
+                local = conn_ctx.engine.expose(segments, tl::bulk_mode::write_only);
+            }
+            TRACE_RECORD("alloc", request_id, begin, TRACE_NOW());
+            {
+                TRACE_SPAN("bulk_pull", request_id);
+                for (const auto &chunk : chunks) {
+                    bulks[chunk.bulk_index](chunk.remote_offset, chunk.size).on(req.get_endpoint()) >> 
+                        local(local_base + chunk.local_offset, chunk.size);
+                }
+            }
+            TRACE_SPAN("reconstruct", request_id);
+
+            // compressed buffers are decompressed into buffers of their own
+            // from the pool; everything else is sliced out of the region
+            struct Decompression {
+                std::shared_ptr<arrow::Buffer> input;
+                std::shared_ptr<arrow::Buffer> *output;
+                int64_t output_size;
+                arrow::util::Codec *codec;
+            };
+            std::vector<Decompression> decompressions;
+            std::unordered_map<int32_t, std::unique_ptr<arrow::util::Codec>> codecs;
+            arrow::Status codec_status;
+
+            int64_t offset = 0;
+            auto make_array_data = [&](std::shared_ptr<arrow::DataType> type, const ArrayDesc &array, int32_t codec) {
+                std::vector<std::shared_ptr<arrow::Buffer>> buffers(array.buffer_sizes.size());
+                for (size_t i = 0; i < array.buffer_sizes.size(); i++) {
+                    if (array.buffer_sizes[i] < 0) {
+                        continue;
+                    }
+                    buffers[i] = arrow::SliceBuffer(region, offset, array.wire_size(i));
+                    offset += PaddedSize(array.wire_size(i));
+                }
+                auto data = arrow::ArrayData::Make(type, array.length, std::move(buffers), array.null_count, array.offset);
+                for (size_t i = 0; i < array.buffer_sizes.size(); i++) {
+                    if (array.buffer_sizes[i] >= 0 && array.compressed_sizes[i] >= 0) {
+                        auto &c = codecs[codec];
+                        if (!c) {
+                            auto created = arrow::util::Codec::Create((arrow::Compression::type)codec);
+                            if (!created.ok()) {
+                                codec_status = created.status();
+                                continue;
+                            }
+                            c = std::move(*created);
+                        }
+                        decompressions.push_back({data->buffers[i], &data->buffers[i], array.buffer_sizes[i], c.get()});
+                    }
+                }
+                return data;
+            };
+
+            std::vector<std::vector<std::shared_ptr<arrow::ArrayData>>> batch_columns;
+            for (const auto &desc : descs) {
+                std::vector<std::shared_ptr<arrow::ArrayData>> columns;
+                for (int64_t i = 0; i < schema->num_fields(); i++) {
+                    std::shared_ptr<arrow::DataType> type = schema->field(i)->type();
+                    std::shared_ptr<arrow::ArrayData> col_data = make_array_data(type, desc.columns[i], desc.codec);
+                    if (type->id() == arrow::Type::DICTIONARY) {
+                        auto value_type = std::static_pointer_cast<arrow::DictionaryType>(type)->value_type();
+                        col_data->dictionary = make_array_data(value_type, desc.dictionaries[i], desc.codec);
+                    }
+                    columns.push_back(col_data);
+                }
+                batch_columns.push_back(columns);
+            }
+
+            if (!codec_status.ok()) {
+                return fail(codec_status);
             }
 
-            tl::bulk local = conn_ctx.engine.expose(segments, tl::bulk_mode::write_only);
-            b.on(req.get_endpoint()) >> local;
-
-            for (int64_t i = 0; i < num_cols; i++) {
-                std::shared_ptr<arrow::DataType> type = schema->field(i)->type();  
-                if (is_binary_like(type->id())) {
-                    std::shared_ptr<arrow::Array> col_arr = std::make_shared<arrow::StringArray>(num_rows, std::move(offset_buffs[i]), std::move(data_buffs[i]));
-                    columns.push_back(col_arr);
-                } else {
-                    std::shared_ptr<arrow::Array> col_arr = std::make_shared<arrow::PrimitiveArray>(type, num_rows, std::move(data_buffs[i]));
-                    columns.push_back(col_arr);
+            int64_t decompress_begin = TRACE_NOW();
+            arrow::Status decompressed = arrow::internal::ParallelFor(static_cast<int>(decompressions.size()), [&](int k) -> arrow::Status {
+                const Decompression &d = decompressions[k];
+                ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Buffer> out, 
+                                      arrow::AllocateBuffer(d.output_size, conn_ctx.pool.get()));
+                ARROW_ASSIGN_OR_RAISE(int64_t len, d.codec->Decompress(d.input->size(), d.input->data(), 
+                                                                       d.output_size, out->mutable_data()));
+                if (len != d.output_size) {
+                    return arrow::Status::IOError("Decompressed ", len, " bytes, expected ", d.output_size);
                 }
+                *d.output = out;
+                return arrow::Status::OK();
+            });
+            if (!decompressed.ok()) {
+                return fail(decompressed);
+            }
+            if (!decompressions.empty()) {
+                TRACE_RECORD("decompress", request_id, decompress_begin, TRACE_NOW());
             }
 
-            batch = arrow::RecordBatch::Make(schema, num_rows, columns);
-            return req.respond(0);
+            for (size_t b = 0; b < descs.size(); b++) {
+                std::vector<std::shared_ptr<arrow::Array>> columns;
+                for (const auto &col_data : batch_columns[b]) {
+                    columns.push_back(arrow::MakeArray(col_data));
+                }
+                batches.push_back(arrow::RecordBatch::Make(schema, descs[b].num_rows, columns));
+            }
+            return req.respond(kTransferOk);
         };
     conn_ctx.engine.define("do_rdma", f);
     tl::remote_procedure get_next_batch = conn_ctx.engine.define("get_next_batch");
 
-    int e = get_next_batch.on(conn_ctx.endpoint)(last);
+    int e = get_next_batch.on(conn_ctx.endpoint)(scan_ctx.uuid, max_batches, max_bytes, request_id);
 
-    if (e == 0) {
-        return batch;
+    if (!rdma_status.ok()) {
+        return rdma_status;
+    }
+    if (e == kScanFailed) {
+        return arrow::Status::IOError("Scan ", scan_ctx.uuid, " failed on the server");
+    }
+    if (e == kBatchesSent) {
+        return batches;
     } else {
-        return nullptr;
+        return std::vector<std::shared_ptr<arrow::RecordBatch>>();
     }
 }
 
-arrow::Status Main(char **argv) {
+arrow::Status Main(int argc, char **argv) {
+    std::vector<std::string> args;
+    BenchmarkOptions options = ParseBenchmarkOptions(argc, argv, args);
+    if (args.size() < 2) {
+        std::cout << "./tc <port|address> <selectivity> [max_batches] [max_bytes] [pool_size] [coalesce_bytes|adaptive] [compression] [files_per_scan]\n";
+        std::cout << BenchmarkUsage();
+        exit(0);
+    }
+
     // connection info
-    std::string uri_base = "ofi+verbs;ofi_rxm://10.0.2.50:";
-    std::string uri = uri_base + argv[1];
-    std::string selectivity = argv[2];
+    std::string uri = ServerUri(args[0]);
+    if (!options.selectivity_flag) {
+        options.selectivity = args[1];
+    }
+
+    // fetch params: how many batches / bytes a single get_next_batch may return
+    size_t max_batches = args.size() > 2 ? std::stoul(args[2]) : 64;
+    int64_t max_bytes = args.size() > 3 ? std::stoll(args[3]) : 64 << 20;
+    int64_t pool_size = args.size() > 4 ? std::stoll(args[4]) : 1LL << 30;
+
+    // coalescing target for the server, in bytes, or "adaptive"
+    std::string coalesce = args.size() > 5 ? args[5] : "0";
+    // codec for column buffers on the wire, e.g. "lz4" or "zstd"
+    std::string compression = args.size() > 6 ? args[6] : "";
+    // how many files go into one scan request; the server scans them in parallel
+    int files_per_scan = args.size() > 7 ? std::stoi(args[7]) : 1;
 
     // query params
-    auto filter = 
-        cp::greater(cp::field_ref("total_amount"), cp::literal(-200));
-    if (selectivity == "10") {
-        filter = cp::greater(cp::field_ref("total_amount"), cp::literal(27));
-    } else if (selectivity == "1") {
-        filter = cp::greater(cp::field_ref("total_amount"), cp::literal(69));
-    }
+    auto filter = SelectivityFilter(options.selectivity);
 
-    auto schema = arrow::schema({
-        arrow::field("VendorID", arrow::int64()),
-        arrow::field("tpep_pickup_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-        arrow::field("tpep_dropoff_datetime", arrow::timestamp(arrow::TimeUnit::MICRO)),
-        arrow::field("passenger_count", arrow::int64()),
-        arrow::field("trip_distance", arrow::float64()),
-        arrow::field("RatecodeID", arrow::int64()),
-        arrow::field("store_and_fwd_flag", arrow::utf8()),
-        arrow::field("PULocationID", arrow::int64()),
-        arrow::field("DOLocationID", arrow::int64()),
-        arrow::field("payment_type", arrow::int64()),
-        arrow::field("fare_amount", arrow::float64()),
-        arrow::field("extra", arrow::float64()),
-        arrow::field("mta_tax", arrow::float64()),
-        arrow::field("tip_amount", arrow::float64()),
-        arrow::field("tolls_amount", arrow::float64()),
-        arrow::field("improvement_surcharge", arrow::float64()),
-        arrow::field("total_amount", arrow::float64())
-    });
+    auto schema = DatasetSchema();
+    ARROW_ASSIGN_OR_RAISE(auto projection_schema, ProjectSchema(schema, options.columns));
 
     // scan
-    ConnCtx conn_ctx = Init(uri);
-    int64_t total_rows = 0;
-    std::shared_ptr<arrow::RecordBatch> batch;
-
-    {
-        MEASURE_FUNCTION_EXECUTION_TIME
-        for (int i = 1; i <= 200; i++) {
-            std::string filepath = "/mnt/cephfs/dataset/16MB.uncompressed.parquet." + std::to_string(i);
-            std::cout << filepath << std::endl;
-            ARROW_ASSIGN_OR_RAISE(auto scan_req, GetScanRequest(filepath, filter, schema, schema));
-            Scan(conn_ctx, scan_req);
-            bool last = (i == 200);
-            while ((batch = GetNextBatch(conn_ctx, schema, last).ValueOrDie()) != nullptr) {
-                total_rows += batch->num_rows();
-                std::cout << batch->ToString() << std::endl;
+    ConnCtx conn_ctx = Init(uri, pool_size);
+    std::vector<std::string> files = BenchmarkFiles(options);
+
+    ARROW_RETURN_NOT_OK(RunBenchmark(options, [&](BenchmarkRecorder &recorder) -> arrow::Status {
+        for (size_t i = 0; i < files.size(); i += files_per_scan) {
+            std::vector<std::string> filepaths(files.begin() + i, 
+                                               files.begin() + std::min(files.size(), i + files_per_scan));
+            ARROW_ASSIGN_OR_RAISE(auto scan_req, GetScanRequest(filepaths[0], filter, projection_schema, schema));
+            scan_req.stub.paths = filepaths;
+            if (coalesce == "adaptive") {
+                scan_req.stub.coalesce_adaptive = true;
+            } else {
+                scan_req.stub.coalesce_bytes = std::stoll(coalesce);
+            }
+            scan_req.stub.compression = compression;
+
+            recorder.BeginScan();
+            ScanCtx scan_ctx = Scan(conn_ctx, scan_req);
+            while (true) {
+                auto next = GetNextBatch(conn_ctx, scan_ctx, max_batches, max_bytes);
+                if (!next.ok()) {
+                    // don't leave the session and its producers behind on the server
+                    Clear(conn_ctx, scan_ctx);
+                    return next.status();
+                }
+                auto batches = std::move(*next);
+                if (batches.empty()) {
+                    break;
+                }
+                int64_t rows = 0, bytes = 0;
+                for (const auto &batch : batches) {
+                    rows += batch->num_rows();
+                    bytes += BatchBytes(*batch);
+                }
+                recorder.Batch(rows, bytes);
             }
         }
+        return arrow::Status::OK();
+    }));
+
+    if (!options.trace.empty()) {
+#ifdef ENABLE_TRACING
+        // one file with the spans of both sides
+        Tracer::Get().SetProcessName("tc");
+        tl::remote_procedure trace_events = conn_ctx.engine.define("trace_events");
+        std::string server_events = trace_events.on(conn_ctx.endpoint)();
+        Tracer::Get().Dump(options.trace, server_events);
+#else
+        std::cerr << "Built without tracing, configure with -DTRACING=ON" << std::endl;
+#endif
     }
-    
-    std::cout << "Total rows read: " << total_rows << std::endl;
+
+    conn_ctx.pool->release();
+    conn_ctx.pool.reset();
     conn_ctx.engine.finalize();
 
     return arrow::Status::OK();
 }
 
 int main(int argc, char** argv) {
-    Main(argv);
+    arrow::Status s = Main(argc, argv);
+    if (!s.ok()) {
+        std::cerr << s.ToString() << std::endl;
+        return 1;
+    }
 }
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/array/concatenate.h>
+
+#include <thallium.hpp>
+
+#include "transfer.h"
+
+
+// The batches one producer has read but not queued yet.
+struct coalesce_buffer {
+    std::vector<std::shared_ptr<arrow::RecordBatch>> pending;
+    int64_t rows = 0;
+    int64_t bytes = 0;
+};
+
+// Concatenates the small batches a selective scan produces into batches of
+// roughly a target row count or byte size before they are queued, so each
+// one is worth its share of an RPC and a bulk transfer. In adaptive mode the
+// byte target is tuned from the transfer throughput get_next_batch observes.
+// The target is shared by all producers of a scan; each producer keeps its
+// own coalesce_buffer.
+class batch_coalescer {
+    private:
+        static const int64_t kMinAdaptiveBytes = 64LL << 10;
+        static const int64_t kMaxAdaptiveBytes = 64LL << 20;
+        // transfers per throughput sample in adaptive mode
+        static const int kWindow = 8;
+
+        int64_t target_rows;
+        std::atomic<int64_t> target_bytes;
+        bool adaptive;
+
+        // adaptive state, only touched from get_next_batch
+        thallium::mutex m;
+        int64_t window_bytes = 0;
+        double window_seconds = 0;
+        int window_count = 0;
+        double last_throughput = 0;
+        bool growing = true;
+
+        bool full(const coalesce_buffer &buffer) const {
+            return (target_rows > 0 && buffer.rows >= target_rows) ||
+                   (target_bytes > 0 && buffer.bytes >= target_bytes);
+        }
+
+    public:
+        batch_coalescer(int64_t target_rows, int64_t target_bytes, bool adaptive)
+            : target_rows(target_rows), target_bytes(target_bytes), adaptive(adaptive) {
+            if (adaptive && this->target_bytes <= 0) {
+                this->target_bytes = 1LL << 20;
+            }
+        }
+
+        bool enabled() const { return target_rows > 0 || target_bytes > 0; }
+
+        int64_t current_target_bytes() const { return target_bytes; }
+
+        // Adds a batch; any batches ready to be queued are appended to `out`.
+        void push(coalesce_buffer &buffer, const std::shared_ptr<arrow::RecordBatch> &batch,
+                  std::vector<std::shared_ptr<arrow::RecordBatch>> &out) {
+            if (!enabled()) {
+                out.push_back(batch);
+                return;
+            }
+            buffer.pending.push_back(batch);
+            buffer.rows += batch->num_rows();
+            buffer.bytes += BatchSize(batch);
+            if (full(buffer)) {
+                flush(buffer, out);
+            }
+        }
+
+        void flush(coalesce_buffer &buffer, std::vector<std::shared_ptr<arrow::RecordBatch>> &out) {
+            if (buffer.pending.empty()) {
+                return;
+            }
+            if (buffer.pending.size() == 1) {
+                out.push_back(buffer.pending[0]);
+            } else {
+                auto combined = combine(buffer);
+                if (combined.ok()) {
+                    out.push_back(*combined);
+                } else {
+                    // e.g. dictionaries that cannot be merged; ship them as they are
+                    out.insert(out.end(), buffer.pending.begin(), buffer.pending.end());
+                }
+            }
+            buffer.pending.clear();
+            buffer.rows = 0;
+            buffer.bytes = 0;
+        }
+
+        // Records one transfer. Every kWindow transfers the throughput is
+        // compared to the previous window's and the byte target keeps moving
+        // in the same direction if it improved, or turns around if not.
+        void observe(int64_t bytes, double seconds) {
+            if (!adaptive) {
+                return;
+            }
+            std::lock_guard<thallium::mutex> lock(m);
+            window_bytes += bytes;
+            window_seconds += seconds;
+            if (++window_count < kWindow || window_seconds <= 0) {
+                return;
+            }
+            double throughput = window_bytes / window_seconds;
+            if (throughput < last_throughput) {
+                growing = !growing;
+            }
+            last_throughput = throughput;
+            int64_t next = growing ? target_bytes * 2 : target_bytes / 2;
+            if (next < kMinAdaptiveBytes) {
+                next = kMinAdaptiveBytes;
+            } else if (next > kMaxAdaptiveBytes) {
+                next = kMaxAdaptiveBytes;
+            }
+            target_bytes = next;
+            window_bytes = 0;
+            window_seconds = 0;
+            window_count = 0;
+        }
+
+    private:
+        arrow::Result<std::shared_ptr<arrow::RecordBatch>> combine(const coalesce_buffer &buffer) {
+            std::shared_ptr<arrow::Schema> schema = buffer.pending[0]->schema();
+            std::vector<std::shared_ptr<arrow::Array>> columns;
+            for (int i = 0; i < schema->num_fields(); i++) {
+                arrow::ArrayVector chunks;
+                for (const auto &batch : buffer.pending) {
+                    chunks.push_back(batch->column(i));
+                }
+                ARROW_ASSIGN_OR_RAISE(auto column, arrow::Concatenate(chunks));
+                columns.push_back(column);
+            }
+            return arrow::RecordBatch::Make(schema, buffer.rows, columns);
+        }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <arrow/result.h>
+#include <arrow/type.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/metadata.h>
+
+#include "stats.h"
+
+
+// What a scan needs from a file's footer: the parsed parquet::FileMetaData
+// and the Arrow schema it infers. Fragments get readers built over the
+// cached metadata, so a cached file's footer is neither read nor parsed
+// again, and no reader (nor the file it holds open) outlives its scan.
+struct CachedMetadata {
+    std::shared_ptr<parquet::FileMetaData> metadata;
+    std::shared_ptr<arrow::Schema> schema;
+};
+
+// Server-wide LRU of file metadata, bounded by the serialized size of the
+// cached footers. Keys name a file version (see FileCacheId), so a changed
+// file misses and its stale entry ages out.
+class MetadataCache {
+    private:
+        typedef std::list<std::pair<std::string, CachedMetadata>> Entries;
+
+        int64_t capacity;
+        int64_t used = 0;
+        Entries lru;
+        std::unordered_map<std::string, Entries::iterator> index;
+        std::mutex m;
+
+        static int64_t Charge(const CachedMetadata &metadata) {
+            return metadata.metadata->size();
+        }
+
+    public:
+        Counter hits;
+        Counter misses;
+
+        explicit MetadataCache(int64_t capacity) : capacity(capacity) {}
+
+        bool enabled() const { return capacity > 0; }
+
+        // the cached metadata of `key`, or that of the reader `open` returns,
+        // cached
+        arrow::Result<CachedMetadata> GetOrOpen(
+                const std::string &key,
+                const std::function<arrow::Result<std::shared_ptr<parquet::arrow::FileReader>>()> &open) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                auto it = index.find(key);
+                if (it != index.end()) {
+                    lru.splice(lru.begin(), lru, it->second);
+                    hits.add();
+                    return it->second->second;
+                }
+            }
+            misses.add();
+
+            // opened outside the lock; two scans racing on a miss both read
+            // the footer and the second insert wins
+            CachedMetadata metadata;
+            ARROW_ASSIGN_OR_RAISE(auto reader, open());
+            metadata.metadata = reader->parquet_reader()->metadata();
+            ARROW_RETURN_NOT_OK(reader->GetSchema(&metadata.schema));
+
+            std::lock_guard<std::mutex> lock(m);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                used -= Charge(it->second->second);
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            lru.emplace_front(key, metadata);
+            index[key] = lru.begin();
+            used += Charge(metadata);
+            while (used > capacity && lru.size() > 1) {
+                used -= Charge(lru.back().second);
+                index.erase(lru.back().first);
+                lru.pop_back();
+            }
+            return metadata;
+        }
+
+        int64_t size() {
+            std::lock_guard<std::mutex> lock(m);
+            return lru.size();
+        }
+
+        int64_t bytes() {
+            std::lock_guard<std::mutex> lock(m);
+            return used;
+        }
+};
+
+// A local file's cache key: its path, modification time and size.
+inline arrow::Result<std::string> FileCacheId(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return arrow::Status::IOError("Cannot stat ", path);
+    }
+    return path + "@" + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) +
+           ":" + std::to_string(st.st_size);
+}
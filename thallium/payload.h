@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <vector>
 #include <string>
@@ -8,10 +10,62 @@
 
 #include <arrow/compute/exec/expression.h>
 
+#include "slab.h"
+
+
+// what get_next_batch responds with: batches were sent, the scan is over,
+// or the scan failed on the server and what was sent is incomplete
+const int kBatchesSent = 0;
+const int kScanDone = 1;
+const int kScanFailed = 2;
+
+// what do_rdma responds with: the batches were received, or the client
+// could not rebuild them
+const int kTransferOk = 0;
+const int kTransferFailed = 1;
+
+// every buffer inside a transfer starts at a multiple of this, so the
+// receiver can slice Arrow buffers straight out of one contiguous region
+const int64_t kTransferAlignment = 64;
+
+inline int64_t PaddedSize(int64_t size) {
+    return (size + kTransferAlignment - 1) / kTransferAlignment * kTransferAlignment;
+}
+
+// the protocol of a mercury address, e.g. "na+sm" for "na+sm://1234-0"
+inline std::string ProtocolOf(const std::string &address) {
+    size_t end = address.find("://");
+    return end == std::string::npos ? address : address.substr(0, end);
+}
+
+// na+sm moves bulk data with a single cross-process copy (CMA) and needs
+// no memory pinning, so there is nothing to gain from staging copies
+inline bool IsSharedMemory(const std::string &address) {
+    std::string protocol = ProtocolOf(address);
+    return protocol == "na+sm" || protocol == "sm";
+}
+
+// servers given by port alone are reached over IB
+const std::string kVerbsUriBase = "ofi+verbs;ofi_rxm://10.0.2.50:";
+
+// a port of the IB server, or a full address such as the na+sm address a
+// co-located server prints at startup
+inline std::string ServerUri(const std::string &server) {
+    return server.find("://") == std::string::npos ? kVerbsUriBase + server : server;
+}
+
+// what a client of `server_uri` listens on: the server's protocol, bound to
+// the IB interface over IB
+inline std::string ListenAddress(const std::string &server_uri) {
+    return server_uri.compare(0, kVerbsUriBase.size(), kVerbsUriBase) == 0 
+        ? "verbs://ibp130s0" : ProtocolOf(server_uri);
+}
 
 struct ConnCtx {
     thallium::engine engine;
     thallium::endpoint endpoint;
+    // receive buffers, registered once for the lifetime of the connection
+    std::shared_ptr<SlabMemoryPool> pool;
 };
 
 struct ScanCtx {
@@ -32,6 +86,22 @@ class ScanReqRPCStub {
 
         std::string path;
 
+        // more files to scan in the same request; `path` may also name a
+        // directory or a glob pattern. With `ordered`, batches come back
+        // file by file in this order, otherwise as the files produce them
+        std::vector<std::string> paths;
+        bool ordered = false;
+
+        // coalescing target for the batches of this scan: 0 disables a
+        // bound, and adaptive mode tunes the byte target on the server
+        int64_t coalesce_rows = 0;
+        int64_t coalesce_bytes = 0;
+        bool coalesce_adaptive = false;
+
+        // codec to compress column buffers with (e.g. "lz4", "zstd"), empty
+        // for none; the server falls back to none if it lacks the codec
+        std::string compression;
+
         ScanReqRPCStub() {}
         ScanReqRPCStub(
             std::string path,
@@ -46,6 +116,8 @@ class ScanReqRPCStub {
         template<typename A>
         void save(A& ar) const {
             ar & path;
+            ar & paths;
+            ar & ordered;
 
             ar & filter_buffer_size;
             ar.write(filter_buffer, filter_buffer_size);
@@ -55,11 +127,18 @@ class ScanReqRPCStub {
 
             ar & projection_schema_buffer_size;
             ar.write(projection_schema_buffer, projection_schema_buffer_size);
+
+            ar & coalesce_rows;
+            ar & coalesce_bytes;
+            ar & coalesce_adaptive;
+            ar & compression;
         }
 
         template<typename A>
         void load(A& ar) {
             ar & path;
+            ar & paths;
+            ar & ordered;
 
             ar & filter_buffer_size;
             filter_buffer = new uint8_t[filter_buffer_size];
@@ -72,10 +151,80 @@ class ScanReqRPCStub {
             ar & projection_schema_buffer_size;
             projection_schema_buffer = new uint8_t[projection_schema_buffer_size];
             ar.read(projection_schema_buffer, projection_schema_buffer_size);
+
+            ar & coalesce_rows;
+            ar & coalesce_bytes;
+            ar & coalesce_adaptive;
+            ar & compression;
+        }
+};
+
+// The layout of one array inside a transfer: its ArrayData buffers in order,
+// with -1 for a buffer that is not sent (e.g. the validity bitmap of an
+// array without nulls). A buffer with a compressed size goes on the wire
+// compressed with the batch's codec; buffer_sizes is always the raw size.
+class ArrayDesc {
+    public:
+        int64_t length = 0;
+        int64_t null_count = 0;
+        int64_t offset = 0;
+        std::vector<int64_t> buffer_sizes;
+        std::vector<int64_t> compressed_sizes;
+
+        int64_t wire_size(size_t i) const {
+            return compressed_sizes[i] >= 0 ? compressed_sizes[i] : buffer_sizes[i];
+        }
+
+        template<typename A>
+        void serialize(A& ar) {
+            ar & length;
+            ar & null_count;
+            ar & offset;
+            ar & buffer_sizes;
+            ar & compressed_sizes;
+        }
+};
+
+// The layout of one record batch inside a multi-batch transfer. Every column
+// has an entry in `dictionaries`, empty unless it is dictionary-encoded.
+class BatchDesc {
+    public:
+        int64_t num_rows;
+        // an arrow::Compression::type
+        int32_t codec;
+        std::vector<ArrayDesc> columns;
+        std::vector<ArrayDesc> dictionaries;
+
+        template<typename A>
+        void serialize(A& ar) {
+            ar & num_rows;
+            ar & codec;
+            ar & columns;
+            ar & dictionaries;
+        }
+};
+
+// `size` bytes at `remote_offset` of the transfer's bulk `bulk_index`, to be
+// pulled to `local_offset` of the receiver's region.
+class TransferChunk {
+    public:
+        int32_t bulk_index;
+        int64_t remote_offset;
+        int64_t local_offset;
+        int64_t size;
+
+        template<typename A>
+        void serialize(A& ar) {
+            ar & bulk_index;
+            ar & remote_offset;
+            ar & local_offset;
+            ar & size;
         }
 };
 
 struct ScanReq {
     ScanReqRPCStub stub;
     std::shared_ptr<arrow::Schema> schema;
+    // the serialized filter and schemas the stub points into
+    std::vector<std::shared_ptr<arrow::Buffer>> buffers;
 };
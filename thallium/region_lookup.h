@@ -0,0 +1,172 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arrow/result.h>
+#include <arrow/status.h>
+
+#include <yokan/cxx/database.hpp>
+
+#include "catalog.h"
+#include "stats.h"
+#include "stats_index.h"
+
+
+// What yokan holds for a dataset path: its region ID, and its FileStats if
+// the ingest recorded them (null otherwise), parsed once when fetched.
+struct RegionEntry {
+    std::string region;
+    std::shared_ptr<const FileStats> stats;
+};
+
+// Resolves dataset paths to bake region IDs and statistics through yokan,
+// caching them in process. The cache is dropped whenever an ingest run has
+// bumped the generation key since the last Refresh, and single entries can be
+// dropped when their region turns out to be gone.
+class RegionLookup {
+    private:
+        yokan::Database &db;
+        std::unordered_map<std::string, RegionEntry> regions;
+        std::string generation;
+        std::mutex m;
+
+        // value sizes first, then the values, two RPCs for any number of
+        // paths; each path's region and statistics keys go in the same call
+        void Fetch(const std::vector<std::string> &paths) {
+            if (paths.empty()) {
+                return;
+            }
+            std::vector<std::string> key_strings;
+            for (const auto &path : paths) {
+                key_strings.push_back(path);
+                key_strings.push_back(StatsKey(path));
+            }
+            size_t count = key_strings.size();
+            std::vector<const void*> keys;
+            std::vector<size_t> key_sizes;
+            for (const auto &key : key_strings) {
+                keys.push_back(key.data());
+                key_sizes.push_back(key.size());
+            }
+            std::vector<size_t> value_sizes(count);
+            db.lengthMulti(count, keys.data(), key_sizes.data(), value_sizes.data());
+
+            // keys that are missing get an empty buffer
+            std::vector<bool> found(count);
+            std::vector<std::string> values(count);
+            std::vector<void*> value_ptrs;
+            for (size_t i = 0; i < count; i++) {
+                found[i] = value_sizes[i] != YOKAN_KEY_NOT_FOUND;
+                value_sizes[i] = found[i] ? value_sizes[i] : 0;
+                values[i].resize(value_sizes[i]);
+                value_ptrs.push_back(&values[i][0]);
+            }
+            db.getMulti(count, keys.data(), key_sizes.data(), value_ptrs.data(), value_sizes.data());
+            for (size_t i = 0; i < count; i++) {
+                found[i] = found[i] && value_sizes[i] <= values[i].size();
+                if (found[i]) {
+                    values[i].resize(value_sizes[i]);
+                }
+            }
+
+            // paths without a region stay uncached
+            std::lock_guard<std::mutex> lock(m);
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (found[2 * i]) {
+                    RegionEntry &entry = regions[paths[i]];
+                    entry.region = values[2 * i];
+                    entry.stats = nullptr;
+                    if (found[2 * i + 1] && !values[2 * i + 1].empty()) {
+                        auto stats = ParseFileStats(values[2 * i + 1]);
+                        if (stats.ok()) {
+                            entry.stats = std::make_shared<const FileStats>(std::move(*stats));
+                        } else {
+                            std::cerr << "Ignoring statistics of " << paths[i] << ": "
+                                      << stats.status().ToString() << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+
+    public:
+        Counter hits;
+        Counter misses;
+
+        explicit RegionLookup(yokan::Database &db) : db(db) {}
+
+        // one lookup of the generation key; clears the cache if it moved
+        void Refresh() {
+            std::string current;
+            try {
+                size_t size = db.length(kIngestGenerationKey.data(), kIngestGenerationKey.size());
+                current.resize(size);
+                db.get(kIngestGenerationKey.data(), kIngestGenerationKey.size(), &current[0], &size);
+                current.resize(size);
+            } catch (const std::exception &) {
+                // never ingested with a generation, nothing to compare
+            }
+            std::lock_guard<std::mutex> lock(m);
+            if (current != generation) {
+                regions.clear();
+                generation = current;
+            }
+        }
+
+        // resolves every uncached path of a request in one multi-get
+        arrow::Status Prefetch(const std::vector<std::string> &paths) {
+            std::vector<std::string> missing;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                for (const auto &path : paths) {
+                    if (regions.find(path) == regions.end()) {
+                        missing.push_back(path);
+                    }
+                }
+            }
+            try {
+                Fetch(missing);
+            } catch (const std::exception &e) {
+                return arrow::Status::IOError("yokan multi-get: ", e.what());
+            }
+            return arrow::Status::OK();
+        }
+
+        arrow::Result<RegionEntry> Get(const std::string &path) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                auto it = regions.find(path);
+                if (it != regions.end()) {
+                    hits.add();
+                    return it->second;
+                }
+            }
+            misses.add();
+            try {
+                Fetch({path});
+            } catch (const std::exception &e) {
+                return arrow::Status::IOError("yokan get ", path, ": ", e.what());
+            }
+            std::lock_guard<std::mutex> lock(m);
+            auto it = regions.find(path);
+            if (it == regions.end()) {
+                return arrow::Status::KeyError("No bake region for ", path);
+            }
+            return it->second;
+        }
+
+        void Invalidate(const std::string &path) {
+            std::lock_guard<std::mutex> lock(m);
+            regions.erase(path);
+        }
+
+        int64_t size() {
+            std::lock_guard<std::mutex> lock(m);
+            return regions.size();
+        }
+};
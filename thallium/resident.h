@@ -0,0 +1,304 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/localfs.h>
+#include <arrow/io/file.h>
+#include <arrow/util/byte_size.h>
+#include <parquet/arrow/reader.h>
+
+#include "payload.h"
+#include "server_config.h"
+
+
+const int64_t kHugePageSize = 2 << 20;
+// where each buffer starts within an arena
+const int64_t kArenaAlignment = 64;
+
+// Anonymous memory holding the buffers of one resident file, optionally
+// locked and backed by huge pages. Buffers are slices of it, so the arena
+// lives until the last of them is gone, and is registered as one region.
+class ResidentArena : public arrow::MutableBuffer {
+    private:
+        void *base;
+        size_t mapped;
+
+        ResidentArena(void *base, size_t mapped, uint8_t *data, int64_t size)
+            : arrow::MutableBuffer(data, size), base(base), mapped(mapped) {}
+
+    public:
+        static arrow::Result<std::shared_ptr<ResidentArena>> Make(int64_t size, const DatasetConfig &config) {
+            // one extra huge page, so the arena can start on a huge page boundary
+            size_t mapped = (size_t)(size + kHugePageSize);
+            void *base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) {
+                return arrow::Status::IOError("mmap of ", mapped, " bytes: ", strerror(errno));
+            }
+            uint8_t *data = (uint8_t*)(((uintptr_t)base + kHugePageSize - 1) / kHugePageSize * kHugePageSize);
+            std::shared_ptr<ResidentArena> arena(new ResidentArena(base, mapped, data, size));
+            if (config.huge_pages && madvise(base, mapped, MADV_HUGEPAGE) != 0) {
+                std::cerr << "madvise(MADV_HUGEPAGE): " << strerror(errno) << ", using regular pages\n";
+            }
+            if (config.lock && mlock(data, size) != 0) {
+                return arrow::Status::IOError("mlock of ", size, " bytes: ", strerror(errno));
+            }
+            return arena;
+        }
+
+        ~ResidentArena() override {
+            munmap(base, mapped);
+        }
+};
+
+inline int64_t ArenaSize(int64_t size) {
+    return (size + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+}
+
+// The arena bytes an array needs, children and dictionary included.
+inline int64_t ArenaBytes(const arrow::ArrayData &data) {
+    int64_t bytes = 0;
+    for (const auto &buffer : data.buffers) {
+        if (buffer != nullptr) {
+            bytes += ArenaSize(buffer->size());
+        }
+    }
+    for (const auto &child : data.child_data) {
+        bytes += ArenaBytes(*child);
+    }
+    if (data.dictionary != nullptr) {
+        bytes += ArenaBytes(*data.dictionary);
+    }
+    return bytes;
+}
+
+// Copies an array's buffers into `arena` from `offset` on.
+inline std::shared_ptr<arrow::ArrayData> CopyToArena(const std::shared_ptr<arrow::ArrayData> &data,
+                                                     const std::shared_ptr<ResidentArena> &arena,
+                                                     int64_t &offset) {
+    auto copy = data->Copy();
+    for (auto &buffer : copy->buffers) {
+        if (buffer == nullptr) {
+            continue;
+        }
+        auto slice = arrow::SliceMutableBuffer(arena, offset, buffer->size());
+        memcpy(slice->mutable_data(), buffer->data(), buffer->size());
+        offset += ArenaSize(buffer->size());
+        buffer = slice;
+    }
+    for (auto &child : copy->child_data) {
+        child = CopyToArena(child, arena, offset);
+    }
+    if (copy->dictionary != nullptr) {
+        copy->dictionary = CopyToArena(copy->dictionary, arena, offset);
+    }
+    return copy;
+}
+
+// The table as it stays resident: unchanged, or copied into an arena when
+// the config locks it or wants huge pages.
+inline arrow::Result<std::shared_ptr<arrow::Table>> MakeResident(const std::shared_ptr<arrow::Table> &table,
+                                                                  const DatasetConfig &config) {
+    if (!config.lock && !config.huge_pages) {
+        return table;
+    }
+    int64_t size = 0;
+    for (const auto &column : table->columns()) {
+        for (const auto &chunk : column->chunks()) {
+            size += ArenaBytes(*chunk->data());
+        }
+    }
+    ARROW_ASSIGN_OR_RAISE(auto arena, ResidentArena::Make(size, config));
+    int64_t offset = 0;
+    std::vector<std::shared_ptr<arrow::ChunkedArray>> columns;
+    for (const auto &column : table->columns()) {
+        arrow::ArrayVector chunks;
+        for (const auto &chunk : column->chunks()) {
+            chunks.push_back(arrow::MakeArray(CopyToArena(chunk->data(), arena, offset)));
+        }
+        columns.push_back(std::make_shared<arrow::ChunkedArray>(chunks, column->type()));
+    }
+    return arrow::Table::Make(table->schema(), columns, table->num_rows());
+}
+
+// The files of the in-memory mode, each read into a table once at startup.
+// Requests pick files by path and run their own filter and projection over
+// them. Columns a request declares as dictionaries are encoded on first use
+// and kept alongside the plain column.
+class ResidentDataset {
+    private:
+        struct ResidentFile {
+            std::shared_ptr<arrow::Table> table;
+            std::map<std::string, std::shared_ptr<arrow::ChunkedArray>> encoded;
+        };
+
+        DatasetConfig config;
+        std::map<std::string, ResidentFile> files;
+        int64_t total_bytes = 0;
+        // the allocations the resident tables' buffers point into
+        std::unordered_set<const uint8_t*> roots;
+        std::mutex m;
+
+        explicit ResidentDataset(const DatasetConfig &config) : config(config) {}
+
+        // with m held, or before the dataset is shared
+        void AddRoots(const arrow::ArrayData &data) {
+            for (const auto &buffer : data.buffers) {
+                if (buffer == nullptr) {
+                    continue;
+                }
+                const arrow::Buffer *root = buffer.get();
+                while (root->parent() != nullptr) {
+                    root = root->parent().get();
+                }
+                roots.insert(root->data());
+            }
+            for (const auto &child : data.child_data) {
+                AddRoots(*child);
+            }
+            if (data.dictionary != nullptr) {
+                AddRoots(*data.dictionary);
+            }
+        }
+
+        void AddRoots(const arrow::ChunkedArray &column) {
+            for (const auto &chunk : column.chunks()) {
+                AddRoots(*chunk->data());
+            }
+        }
+
+        static arrow::Result<std::shared_ptr<arrow::Table>> ReadFile(const std::string &path) {
+            ARROW_ASSIGN_OR_RAISE(auto input, arrow::io::ReadableFile::Open(path));
+            std::unique_ptr<parquet::arrow::FileReader> reader;
+            ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(input, arrow::default_memory_pool(), &reader));
+            reader->set_use_threads(true);
+            std::shared_ptr<arrow::Table> table;
+            ARROW_RETURN_NOT_OK(reader->ReadTable(&table));
+            return table;
+        }
+
+        // with m held
+        arrow::Result<std::shared_ptr<arrow::ChunkedArray>> Encode(ResidentFile &file, int i,
+                                                                   const arrow::Field &field) {
+            auto it = file.encoded.find(field.name());
+            if (it != file.encoded.end() && it->second->type()->Equals(*field.type())) {
+                return it->second;
+            }
+            ARROW_ASSIGN_OR_RAISE(auto encoded, arrow::compute::DictionaryEncode(file.table->column(i)));
+            if (!encoded.type()->Equals(*field.type())) {
+                ARROW_ASSIGN_OR_RAISE(encoded, arrow::compute::Cast(encoded, field.type()));
+            }
+            auto column = arrow::Table::Make(arrow::schema({arrow::field(field.name(), field.type())}),
+                                             {encoded.chunked_array()});
+            ARROW_ASSIGN_OR_RAISE(column, MakeResident(column, config));
+            file.encoded[field.name()] = column->column(0);
+            total_bytes += arrow::util::TotalBufferSize(*column->column(0));
+            AddRoots(*column->column(0));
+            return column->column(0);
+        }
+
+    public:
+        // Reads every Parquet file under the configured path; files that do
+        // not read as Parquet are skipped.
+        static arrow::Result<std::unique_ptr<ResidentDataset>> Load(const DatasetConfig &config) {
+            std::unique_ptr<ResidentDataset> dataset(new ResidentDataset(config));
+            arrow::fs::LocalFileSystem fs;
+            arrow::fs::FileSelector s;
+            s.base_dir = config.path;
+            s.recursive = true;
+            ARROW_ASSIGN_OR_RAISE(auto infos, fs.GetFileInfo(s));
+            for (const auto &info : infos) {
+                if (!info.IsFile()) {
+                    continue;
+                }
+                auto table = ReadFile(info.path());
+                if (!table.ok()) {
+                    std::cerr << "Skipping " << info.path() << ": " << table.status().ToString() << std::endl;
+                    continue;
+                }
+                ARROW_ASSIGN_OR_RAISE(auto resident, MakeResident(*table, config));
+                dataset->total_bytes += arrow::util::TotalBufferSize(*resident);
+                for (const auto &column : resident->columns()) {
+                    dataset->AddRoots(*column);
+                }
+                dataset->files[info.path()].table = resident;
+            }
+            return dataset;
+        }
+
+        // the resident files a request covers: its explicit paths, or `path`
+        // itself, or every file under `path`
+        std::vector<std::string> Resolve(const ScanReqRPCStub &stub) {
+            if (!stub.paths.empty()) {
+                return stub.paths;
+            }
+            if (files.count(stub.path) > 0) {
+                return {stub.path};
+            }
+            std::string prefix = stub.path;
+            if (!prefix.empty() && prefix.back() != '/') {
+                prefix += '/';
+            }
+            std::vector<std::string> paths;
+            for (auto it = files.lower_bound(prefix);
+                 it != files.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                paths.push_back(it->first);
+            }
+            return paths;
+        }
+
+        // A file's table, with the columns `dataset_schema` declares as
+        // dictionaries dictionary-encoded.
+        arrow::Result<std::shared_ptr<arrow::Table>> Get(const std::string &path, const arrow::Schema &dataset_schema) {
+            auto it = files.find(path);
+            if (it == files.end()) {
+                return arrow::Status::KeyError(path, " is not resident");
+            }
+            ResidentFile &file = it->second;
+            std::shared_ptr<arrow::Table> table = file.table;
+            for (const auto &field : dataset_schema.fields()) {
+                int i = table->schema()->GetFieldIndex(field->name());
+                if (i < 0 || field->type()->id() != arrow::Type::DICTIONARY ||
+                    table->field(i)->type()->Equals(*field->type())) {
+                    continue;
+                }
+                std::shared_ptr<arrow::ChunkedArray> encoded;
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    ARROW_ASSIGN_OR_RAISE(encoded, Encode(file, i, *field));
+                }
+                ARROW_ASSIGN_OR_RAISE(table, table->SetColumn(i, arrow::field(field->name(), field->type()), encoded));
+            }
+            return table;
+        }
+
+        // Whether every one of the allocations starting at `bases` belongs
+        // to the resident tables, rather than to a scan's own results.
+        bool Holds(const std::vector<const uint8_t*> &bases) {
+            std::lock_guard<std::mutex> lock(m);
+            for (const uint8_t *base : bases) {
+                if (roots.count(base) == 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        int64_t size() const { return files.size(); }
+
+        int64_t bytes() {
+            std::lock_guard<std::mutex> lock(m);
+            return total_bytes;
+        }
+};
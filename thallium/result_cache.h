@@ -0,0 +1,107 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arrow/record_batch.h>
+#include <arrow/type.h>
+
+#include "payload.h"
+#include "stats.h"
+
+
+// The batches a scan of one file produced, before coalescing.
+struct CachedResult {
+    std::shared_ptr<arrow::Schema> schema;
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    int64_t bytes = 0;
+};
+
+// Server-wide LRU of scan results, bounded by the bytes of the cached
+// batches. Keys name a file version along with the filter and projection
+// (see ResultKey), so a changed file misses and its stale entry ages out.
+// Cached batches stay alive as long as they are cached, so their buffers are
+// worth keeping registered.
+class ResultCache {
+    private:
+        typedef std::list<std::pair<std::string, std::shared_ptr<const CachedResult>>> Entries;
+
+        int64_t capacity;
+        int64_t used = 0;
+        Entries lru;
+        std::unordered_map<std::string, Entries::iterator> index;
+        std::mutex m;
+
+    public:
+        Counter hits;
+        Counter misses;
+
+        explicit ResultCache(int64_t capacity) : capacity(capacity) {}
+
+        bool enabled() const { return capacity > 0; }
+
+        // a result larger than this is not recorded at all
+        int64_t max_bytes() const { return capacity; }
+
+        std::shared_ptr<const CachedResult> Get(const std::string &key) {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = index.find(key);
+            if (it == index.end()) {
+                misses.add();
+                return nullptr;
+            }
+            lru.splice(lru.begin(), lru, it->second);
+            hits.add();
+            return it->second->second;
+        }
+
+        void Put(const std::string &key, std::shared_ptr<const CachedResult> result) {
+            if (result->bytes > capacity) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                used -= it->second->second->bytes;
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            used += result->bytes;
+            lru.emplace_front(key, std::move(result));
+            index[key] = lru.begin();
+            while (used > capacity) {
+                used -= lru.back().second->bytes;
+                index.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+
+        int64_t size() {
+            std::lock_guard<std::mutex> lock(m);
+            return lru.size();
+        }
+
+        int64_t bytes() {
+            std::lock_guard<std::mutex> lock(m);
+            return used;
+        }
+};
+
+// A scan result's cache key: the file version (see FileCacheId), and the
+// serialized filter, projection and dataset schemas of the request, each
+// prefixed with its length.
+inline std::string ResultKey(const std::string &file_id, const ScanReqRPCStub &stub) {
+    std::string key = file_id;
+    auto append = [&key](const uint8_t *data, size_t size) {
+        key += std::to_string(size) + ":";
+        key.append(reinterpret_cast<const char*>(data), size);
+    };
+    append(stub.filter_buffer, stub.filter_buffer_size);
+    append(stub.projection_schema_buffer, stub.projection_schema_buffer_size);
+    append(stub.dataset_schema_buffer, stub.dataset_schema_buffer_size);
+    return key;
+}
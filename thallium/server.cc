@@ -1,9 +1,11 @@
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
 #include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 
 #include <arrow/api.h>
 #include <arrow/compute/exec/expression.h>
@@ -11,6 +13,7 @@
 #include <arrow/dataset/plan.h>
 #include <arrow/filesystem/api.h>
 #include <arrow/io/api.h>
+#include <arrow/util/byte_size.h>
 #include <arrow/util/checked_cast.h>
 #include <arrow/util/iterator.h>
 
@@ -39,6 +42,14 @@
 #include <abt.h>
 
 #include "ace.h"
+#include "bake_file.h"
+#include "region_lookup.h"
+#include "result_cache.h"
+#include "transfer.h"
+#include "coalesce.h"
+#include "server_config.h"
+#include "trace.h"
+#include "stats.h"
 
 namespace tl = thallium;
 namespace bk = bake;
@@ -46,24 +57,6 @@ namespace cp = arrow::compute;
 namespace yk = yokan;
 
 
-class MeasureExecutionTime{
-  private:
-      const std::chrono::steady_clock::time_point begin;
-      const std::string caller;
-  public:
-      MeasureExecutionTime(const std::string& caller):caller(caller),begin(std::chrono::steady_clock::now()){}
-      ~MeasureExecutionTime(){
-          const auto duration=std::chrono::steady_clock::now()-begin;
-          std::cout << (double)std::chrono::duration_cast<std::chrono::microseconds>(duration).count()/1000<<std::endl;
-      }
-};
-
-
-#ifndef MEASURE_FUNCTION_EXECUTION_TIME
-#define MEASURE_FUNCTION_EXECUTION_TIME const MeasureExecutionTime measureExecutionTime(__FUNCTION__);
-#endif
-
-
 static char* read_input_file(const char* filename) {
     size_t ret;
     FILE*  fp = fopen(filename, "r");
@@ -85,25 +78,67 @@ static char* read_input_file(const char* filename) {
     return buf;
 }
 
+// Live counters, reported by the `stats` RPC.
+struct ServerStats {
+    Counter scans;
+    Counter queued_batches;
+    Counter batches_sent;
+    Counter rows_sent;
+    Counter bytes_sent;
+    Counter transfers_staged;
+    Counter transfers_cached;
+    Counter transfers_exposed;
+    Counter files_skipped;
+    Counter row_groups_skipped;
+    Histogram get_next_batch_us;
+    Histogram queue_wait_us;
+    Histogram build_transfer_us;
+    Histogram do_rdma_us;
+};
+
+ServerStats stats;
+
 class concurrent_queue {
     private:
-        std::deque<std::shared_ptr<arrow::RecordBatch>> batch_queue;
+        std::deque<std::shared_ptr<PreparedBatch>> batch_queue;
         tl::mutex m;
         tl::condition_variable cv;
+        tl::condition_variable not_full;
         bool alive;
+        // producers wait while the queue holds this many batches, 0 for no bound
+        size_t capacity = 0;
     public:
         void start() { alive = true; }
-        void end() { alive = false; }
+
+        void set_capacity(size_t c) { capacity = c; }
+
+        void end() {
+            std::unique_lock<tl::mutex> lock(m);
+            alive = false;
+            lock.unlock();
+            cv.notify_all();
+            not_full.notify_all();
+        }
+
         bool is_alive() { return alive; }
 
-        void push(std::shared_ptr<arrow::RecordBatch> batch) {
+        void push(std::shared_ptr<PreparedBatch> batch) {
             std::unique_lock<tl::mutex> lock(m);
+            while (capacity > 0 && batch_queue.size() >= capacity && is_alive()) {
+                not_full.wait(lock);
+            }
             batch_queue.push_back(batch);
+            stats.queued_batches.add();
             lock.unlock();
             cv.notify_one();
         }
 
-        void clear() { batch_queue.clear(); }
+        void clear() {
+            std::lock_guard<tl::mutex> lock(m);
+            stats.queued_batches.sub(batch_queue.size());
+            batch_queue.clear();
+        }
+
         size_t size() { return batch_queue.size(); }
 
         bool empty() {
@@ -115,8 +150,7 @@ class concurrent_queue {
             return emp;
         }
 
-        void wait_and_pop(std::shared_ptr<arrow::RecordBatch> &batch) {
-            std::cout << "wait and pop " << batch_queue.empty() << " , " << is_alive() << std::endl;
+        void wait_and_pop(std::shared_ptr<PreparedBatch> &batch) {
             std::unique_lock<tl::mutex> lock(m);
             while (batch_queue.empty() && is_alive()) {
                 cv.wait(lock);
@@ -124,42 +158,355 @@ class concurrent_queue {
             if (!batch_queue.empty()) {
                 batch = batch_queue.front();
                 batch_queue.pop_front();
+                stats.queued_batches.sub();
             }
         }
 
-        void pop(std::shared_ptr<arrow::RecordBatch> &batch) {
+        // Waits for at least one batch, then keeps popping without waiting
+        // while the next batch fits into max_batches and max_bytes.
+        void wait_and_pop_many(std::vector<std::shared_ptr<PreparedBatch>> &batches,
+                               size_t max_batches, int64_t max_bytes) {
+            std::unique_lock<tl::mutex> lock(m);
+            while (batch_queue.empty() && is_alive()) {
+                cv.wait(lock);
+            }
+            int64_t total_bytes = 0;
+            while (!batch_queue.empty() && batches.size() < max_batches) {
+                int64_t batch_bytes = batch_queue.front()->wire_size;
+                if (!batches.empty() && total_bytes + batch_bytes > max_bytes) {
+                    break;
+                }
+                total_bytes += batch_bytes;
+                batches.push_back(batch_queue.front());
+                batch_queue.pop_front();
+                stats.queued_batches.sub();
+            }
+            lock.unlock();
+            not_full.notify_all();
+        }
+
+        void pop(std::shared_ptr<PreparedBatch> &batch) {
             std::unique_lock<tl::mutex> lock(m);
             if (!batch_queue.empty()) {
                 batch = batch_queue.front();
                 batch_queue.pop_front();
+                stats.queued_batches.sub();
             }
             lock.unlock();
         }
 };
 
-concurrent_queue cq;
+// State of a single scan: the files it covers, the queues its producer ULTs
+// fill, and the producers themselves. Sessions are keyed by the scan ID
+// returned from `scan`.
+struct ScanSession {
+    std::string uuid;
+    ScanReqRPCStub stub;
+    std::vector<std::string> paths;
+    std::function<arrow::Result<std::shared_ptr<arrow::RecordBatchReader>>(const std::string&)> open;
+    // with a result cache, the version of a file its results are cached
+    // under, empty if they are not cached
+    ResultCache *results = nullptr;
+    std::function<std::string(const std::string&)> result_id;
+
+    // unordered scans share one queue, ordered ones have a queue per file
+    concurrent_queue cq;
+    std::vector<std::unique_ptr<concurrent_queue>> fragment_queues;
+    size_t current_fragment = 0;
+    tl::mutex consumer_m;
+
+    std::atomic<size_t> next_fragment{0};
+    std::atomic<size_t> remaining{0};
+    std::vector<std::unique_ptr<tl::managed<tl::thread>>> producers;
+
+    std::unique_ptr<batch_coalescer> coalescer;
+    std::unique_ptr<arrow::util::Codec> codec;
+    std::atomic<bool> cancelled{false};
+    arrow::Status error;
+    tl::mutex error_m;
+    // the in-memory dataset the scan reads, whose buffers outlive it
+    ResidentDataset *dataset = nullptr;
+
+    // producers borrow the session, so they are stopped and joined before
+    // any member they use (queues, coalescer, codec) is destroyed
+    ~ScanSession() {
+        cancel();
+        producers.clear();
+    }
 
-void scan_handler(void *arg) {
-    arrow::RecordBatchReader *reader = (arrow::RecordBatchReader*)arg;
+    concurrent_queue& queue_for(size_t fragment) {
+        return stub.ordered ? *fragment_queues[fragment] : cq;
+    }
+
+    void next(std::vector<std::shared_ptr<PreparedBatch>> &batches, size_t max_batches, int64_t max_bytes) {
+        if (!stub.ordered) {
+            cq.wait_and_pop_many(batches, max_batches, max_bytes);
+            return;
+        }
+        std::lock_guard<tl::mutex> lock(consumer_m);
+        while (current_fragment < fragment_queues.size()) {
+            fragment_queues[current_fragment]->wait_and_pop_many(batches, max_batches, max_bytes);
+            if (!batches.empty()) {
+                return;
+            }
+            current_fragment++;
+        }
+    }
+
+    // the first error of the scan; it stops the scan and is reported to the
+    // client in place of the end of the scan
+    void fail(const arrow::Status &status) {
+        std::cerr << "Scan " << uuid << " failed: " << status.ToString() << std::endl;
+        {
+            std::lock_guard<tl::mutex> lock(error_m);
+            if (error.ok()) {
+                error = status;
+            }
+        }
+        cancel();
+    }
+
+    bool failed() {
+        std::lock_guard<tl::mutex> lock(error_m);
+        return !error.ok();
+    }
+
+    void cancel() {
+        cancelled = true;
+        cq.end();
+        cq.clear();
+        for (auto &q : fragment_queues) {
+            q->end();
+            q->clear();
+        }
+    }
+};
+
+class session_table {
+    private:
+        std::unordered_map<std::string, std::shared_ptr<ScanSession>> sessions;
+        boost::uuids::random_generator gen;
+        tl::mutex m;
+    public:
+        std::shared_ptr<ScanSession> create() {
+            auto session = std::make_shared<ScanSession>();
+            std::lock_guard<tl::mutex> lock(m);
+            session->uuid = boost::uuids::to_string(gen());
+            sessions[session->uuid] = session;
+            return session;
+        }
+
+        std::shared_ptr<ScanSession> get(const std::string &uuid) {
+            std::lock_guard<tl::mutex> lock(m);
+            auto it = sessions.find(uuid);
+            if (it == sessions.end()) {
+                return nullptr;
+            }
+            return it->second;
+        }
+
+        std::shared_ptr<ScanSession> remove(const std::string &uuid) {
+            std::lock_guard<tl::mutex> lock(m);
+            auto it = sessions.find(uuid);
+            if (it == sessions.end()) {
+                return nullptr;
+            }
+            auto session = it->second;
+            sessions.erase(it);
+            return session;
+        }
+
+        size_t size() {
+            std::lock_guard<tl::mutex> lock(m);
+            return sessions.size();
+        }
+};
+
+session_table st;
+
+// batches a producer may queue ahead of the consumer, per queue
+const size_t kQueueCapacity = 64;
+
+// The allocations (see RootOf) of the buffers a prepared batch sends as
+// they are; compressed copies are per scan anyway.
+static std::vector<const uint8_t*> SentRoots(const PreparedBatch &prepared) {
+    std::vector<const uint8_t*> roots;
+    auto add = [&roots](const PreparedArray &array) {
+        for (size_t i = 0; i < array.data->buffers.size(); i++) {
+            if (IsSent(array.data, i) && array.compressed[i] == nullptr) {
+                roots.push_back(RootOf(array.data->buffers[i])->data());
+            }
+        }
+    };
+    for (size_t i = 0; i < prepared.columns.size(); i++) {
+        add(prepared.columns[i]);
+        if (prepared.dictionaries[i].data != nullptr) {
+            add(prepared.dictionaries[i]);
+        }
+    }
+    return roots;
+}
+
+// Normalizes and (optionally) compresses the ready batches and queues them.
+// The ready batches were read between scan_begin and scan_end.
+// Batches in `cached` are kept by the result cache; any others were made
+// for this scan, e.g. by the coalescer or a filter kernel. A batch only
+// counts as resident if what it sends still points into the resident
+// dataset: Normalize may have copied some of it.
+static bool enqueue(ScanSession *session, concurrent_queue &q, 
+                    std::vector<std::shared_ptr<arrow::RecordBatch>> &ready,
+                    int64_t scan_begin, int64_t scan_end,
+                    const std::unordered_set<const arrow::RecordBatch*> &cached) {
+    for (const auto &b : ready) {
+        auto prepared = PrepareBatch(b, session->codec.get());
+        if (!prepared.ok()) {
+            session->fail(prepared.status());
+            return false;
+        }
+        (*prepared)->resident = cached.count(b.get()) > 0 ||
+                                (session->dataset != nullptr && session->dataset->Holds(SentRoots(**prepared)));
+#ifdef ENABLE_TRACING
+        (*prepared)->trace = {scan_begin, scan_end, TraceNow(), Tracer::Get().ThreadId()};
+#endif
+        q.push(*prepared);
+    }
+    ready.clear();
+    return true;
+}
+
+// Queues the batches of one file, which come from the result cache if
+// `cached` is set; with `record`, also collects them for the result cache.
+// Returns whether the reader ran to its end.
+static bool scan_fragment(ScanSession *session, arrow::RecordBatchReader *reader, concurrent_queue &q,
+                          const CachedResult *cached, CachedResult *record) {
+    std::unordered_set<const arrow::RecordBatch*> cached_batches;
+    if (cached != nullptr) {
+        for (const auto &b : cached->batches) {
+            cached_batches.insert(b.get());
+        }
+    }
     std::shared_ptr<arrow::RecordBatch> batch;
-    reader->ReadNext(&batch);
-    while (batch != nullptr) {
-        cq.push(batch);
-        reader->ReadNext(&batch);
+    std::vector<std::shared_ptr<arrow::RecordBatch>> ready;
+    coalesce_buffer buffer;
+    bool ok = true;
+    if (record != nullptr) {
+        record->schema = reader->schema();
+    }
+    // when reading the batches now in `buffer` began; ReadNext covers both
+    // Parquet decoding and filter evaluation
+    int64_t scan_begin = TRACE_NOW();
+    arrow::Status read = reader->ReadNext(&batch);
+    while (ok && read.ok() && batch != nullptr && !session->cancelled) {
+        if (batch->num_rows() > 0) {
+            if (record != nullptr && record->bytes <= session->results->max_bytes()) {
+                record->batches.push_back(batch);
+                record->bytes += arrow::util::TotalBufferSize(*batch);
+                if (record->bytes > session->results->max_bytes()) {
+                    // too large to ever be cached
+                    record->batches.clear();
+                }
+            }
+            session->coalescer->push(buffer, batch, ready);
+            ok = enqueue(session, q, ready, scan_begin, TRACE_NOW(), cached_batches);
+        }
+        if (buffer.pending.empty()) {
+            scan_begin = TRACE_NOW();
+        }
+        read = reader->ReadNext(&batch);
+    }
+    if (ok) {
+        session->coalescer->flush(buffer, ready);
+        ok = enqueue(session, q, ready, scan_begin, TRACE_NOW(), cached_batches);
+    }
+    if (!read.ok()) {
+        session->fail(read);
+    }
+    return ok && read.ok() && !session->cancelled;
+}
+
+// A producer: scans files of the session until none are left. A file whose
+// result is cached is served from the cache without opening it.
+void scan_handler(void *arg) {
+    ScanSession *session = (ScanSession*)arg;
+    size_t i;
+    while (!session->cancelled && (i = session->next_fragment++) < session->paths.size()) {
+        concurrent_queue &q = session->queue_for(i);
+        const std::string &path = session->paths[i];
+        std::string key;
+        std::shared_ptr<const CachedResult> cached;
+        if (session->results != nullptr) {
+            std::string id = session->result_id(path);
+            if (!id.empty()) {
+                key = ResultKey(id, session->stub);
+                cached = session->results->Get(key);
+            }
+        }
+        auto reader = cached ? arrow::RecordBatchReader::Make(cached->batches, cached->schema)
+                             : session->open(path);
+        if (reader.ok()) {
+            std::shared_ptr<CachedResult> record;
+            if (!key.empty() && !cached) {
+                record = std::make_shared<CachedResult>();
+            }
+            if (scan_fragment(session, reader->get(), q, cached.get(), record.get()) && record) {
+                session->results->Put(key, record);
+            }
+        } else {
+            session->fail(reader.status().WithMessage("Failed to scan ", path, ": ", reader.status().message()));
+        }
+        if (session->stub.ordered) {
+            q.end();
+        } else if (--session->remaining == 0) {
+            session->cq.end();
+        }
     }
 }
 
 
 int main(int argc, char** argv) {
+    // Argobots has to be up before the pools and xstreams below are created,
+    // and stay up until the engine is gone
+    tl::abt scope;
 
     if (argc < 2) {
-        std::cout << "./ts <mode>\n";
-        std::cout << "\nmode: \n\n1: in-memory\n2: ext4-mmap\n3: ext4\n4: bake\n";
+        std::cout << "./ts <mode> [staging_size] [staging_threshold] [num_scan_xstreams] [server_config]\n";
+        std::cout << "\nmode: \n\n1: in-memory\n2: ext4-mmap\n3: ext4\n4: bake\n5: ext4-io_uring\n6: ext4-io_uring-direct\n";
         exit(0);
     }
 
     int mode = atoi(argv[1]);
-    tl::engine engine("verbs://ibp130s0", THALLIUM_SERVER_MODE, true);
+    int64_t staging_size = argc > 2 ? std::stoll(argv[2]) : 256LL << 20;
+    int64_t staging_threshold = argc > 3 ? std::stoll(argv[3]) : -1;
+    int num_scan_xstreams = argc > 4 ? atoi(argv[4]) : 4;
+    ServerConfig config = LoadServerConfig(argc > 5 ? argv[5] : "thallium_config.json", num_scan_xstreams);
+    if (staging_threshold < 0) {
+        // over shared memory the client reads the result buffers directly
+        staging_threshold = IsSharedMemory(config.address) ? 0 : 4LL << 20;
+    }
+
+    // progress, RPC handlers and scan producers each get their own pool and
+    // xstreams, as laid out in the server config; the pools and xstreams are
+    // declared before the engine so they outlive it
+    std::vector<tl::managed<tl::pool>> pools;
+    std::vector<tl::managed<tl::xstream>> xstreams;
+    tl::pool progress_pool = tl::xstream::self().get_main_pools(1)[0];
+    if (config.progress.xstreams > 0) {
+        pools.push_back(tl::pool::create(tl::pool::access::mpmc));
+        progress_pool = *pools.back();
+        CreateXstreams(config.progress, progress_pool, xstreams);
+    }
+    tl::pool rpc_pool = progress_pool;
+    if (config.rpc.xstreams > 0) {
+        pools.push_back(tl::pool::create(tl::pool::access::mpmc));
+        rpc_pool = *pools.back();
+        CreateXstreams(config.rpc, rpc_pool, xstreams);
+    }
+    pools.push_back(tl::pool::create(tl::pool::access::mpmc));
+    tl::pool scan_pool = *pools.back();
+    CreateXstreams(config.scan, scan_pool, xstreams);
+    num_scan_xstreams = config.scan.xstreams;
+
+    tl::engine engine(config.address, THALLIUM_SERVER_MODE, progress_pool, rpc_pool);
     margo_instance_id mid = engine.get_margo_instance();
     hg_addr_t svr_addr;
     hg_return_t hret = margo_addr_self(mid, &svr_addr);
@@ -185,125 +532,323 @@ int main(int argc, char** argv) {
 
     tl::remote_procedure do_rdma = engine.define("do_rdma");
 
+    // small transfers are copied into this slab, registered once up front;
+    // long-lived buffers keep their registrations in the bulk cache
+    SlabMemoryPool staging_pool(engine, staging_size, tl::bulk_mode::read_only);
+    bulk_cache bc(engine, config.registration_cache_bytes);
+    engine.push_finalize_callback([&staging_pool, &bc]() {
+        bc.clear();
+        staging_pool.release();
+    });
+
     // std::unordered_map<std::string, std::shared_ptr<arrow::RecordBatchReader>> reader_map;
     bk::client bcl(mid);
     bk::provider_handle bph(bcl, svr_addr, 0);
     bph.set_eager_limit(0);
     bk::target tid = bp->list_targets()[0];
 
-    // create a secondary execution stream from the same progress pool
-    tl::managed<tl::xstream> xstream = 
-        tl::xstream::create(tl::scheduler::predef::deflt, engine.get_progress_pool());
+    // mode 1 serves the dataset from memory, loaded once here
+    std::unique_ptr<ResidentDataset> resident;
+    if (mode == 1) {
+        auto loaded = ResidentDataset::Load(config.dataset);
+        if (!loaded.ok()) {
+            std::cerr << "Error: loading " << config.dataset.path << ": " << loaded.status().ToString() << std::endl;
+            margo_addr_free(mid, svr_addr);
+            return -1;
+        }
+        resident = std::move(*loaded);
+        std::cout << "Loaded " << resident->size() << " files, " << resident->bytes() << " bytes into memory"
+                  << std::endl;
+    }
+
+    // parsed footers, shared by the scans of every session
+    MetadataCache metadata_cache(config.metadata_cache_bytes);
+
+    // path -> region IDs, resolved in bulk when a scan starts
+    RegionLookup region_lookup(db);
+
+    // scan results by file version, filter and projection; off unless the
+    // config gives it a budget
+    ResultCache result_cache(config.result_cache_bytes);
+
+    // the version of a file results are cached under; the in-memory dataset
+    // is resident already and never cached
+    auto result_id = [&region_lookup, &mode](const std::string &path) -> std::string {
+        if (mode == 2 || mode == 3 || mode == 5 || mode == 6) {
+            auto id = FileCacheId(path);
+            return id.ok() ? *id : "";
+        } else if (mode == 4) {
+            auto entry = region_lookup.Get(path);
+            return entry.ok() ? "bake:" + entry->region : "";
+        }
+        return "";
+    };
+
+    // opens one file of a scan in the configured storage mode
+    auto open = [&bcl, &bph, &tid, &region_lookup, &mode, &metadata_cache, &resident](const ScanReqRPCStub &stub, const std::string &path) 
+        -> arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> {
+        ScanReqRPCStub file_stub = stub;
+        file_stub.path = path;
+        if (mode == 1) {
+            return ScanResident(*resident, file_stub);
+        } else if (mode == 2) {
+            return ScanEXT4MMap(file_stub, &metadata_cache);
+        } else if (mode == 3) {
+            return ScanEXT4(file_stub, &metadata_cache);
+        } else if (mode == 5 || mode == 6) {
+#ifdef HAVE_URING
+            return ScanEXT4Uring(file_stub, mode == 6, &metadata_cache);
+#else
+            return arrow::Status::NotImplemented("Mode ", mode, " needs ts built with liburing");
+#endif
+        } else if (mode == 4) {
+            // with statistics from the ingest, skip the file or the row
+            // groups the filter rules out before reading any of them
+            ARROW_ASSIGN_OR_RAISE(auto entry, region_lookup.Get(path));
+            std::vector<int> row_groups;
+            if (entry.stats != nullptr) {
+                ARROW_ASSIGN_OR_RAISE(row_groups, MatchingRowGroups(*entry.stats, file_stub));
+                stats.row_groups_skipped.add(entry.stats->row_groups.size() - row_groups.size());
+                if (row_groups.empty()) {
+                    stats.files_skipped.add();
+                    return EmptyScan(file_stub);
+                }
+            }
+
+            // get the rid from pathname; a region that is gone means a stale
+            // entry, so look it up once more
+            bk::region rid(entry.region);
+            auto file = BakeRegionFile::Open(bcl, bph, tid, rid);
+            if (!file.ok()) {
+                region_lookup.Invalidate(path);
+                ARROW_ASSIGN_OR_RAISE(entry, region_lookup.Get(path));
+                rid = bk::region(entry.region);
+                ARROW_ASSIGN_OR_RAISE(file, BakeRegionFile::Open(bcl, bph, tid, rid));
+            }
+
+            // scan data from bake, reading only the ranges Parquet asks for
+            return ScanBake(file_stub, *file, entry.region, &metadata_cache, std::move(row_groups));
+        }
+        return arrow::Status::Invalid("Unknown mode ", mode);
+    };
 
     std::function<void(const tl::request&, const ScanReqRPCStub&)> scan = 
-        [&mid, &svr_addr, &bp, &bcl, &bph, &tid, &db, &mode, &xstream](const tl::request &req, const ScanReqRPCStub& stub) {
+        [&mode, &scan_pool, &num_scan_xstreams, &open, &region_lookup, &result_cache, &result_id, &resident](const tl::request &req, const ScanReqRPCStub& stub) {
             arrow::dataset::internal::Initialize();
-            std::shared_ptr<arrow::RecordBatchReader> reader;
 
+            std::shared_ptr<ScanSession> session = st.create();
+            session->stub = stub;
             if (mode == 1) {
-                std::cout << "running transport benchmark\n";
-                cp::ExecContext exec_ctx;
-                reader = ScanBenchmark(exec_ctx, stub).ValueOrDie();
-            } else if (mode == 2) {
-                std::cout << "scanning data from ext4 using mmap: " << stub.path.c_str() << std::endl;
-                reader = ScanEXT4MMap(stub).ValueOrDie();
-            } else if (mode == 3) {
-                std::cout << "scanning data from ext4: " << stub.path.c_str() << std::endl;
-                reader = ScanEXT4(stub).ValueOrDie();
+                // paths name resident files, not what is on disk now
+                session->paths = resident->Resolve(stub);
             } else if (mode == 4) {
-                std::cout << "scanning data from bake: " << stub.path.c_str() << std::endl;
-                // get the rid from pathname
-                size_t value_size = 28;
-                void *value_buf = malloc(28);
-                
-                db.get((void*)stub.path.c_str(), stub.path.length(), value_buf, &value_size);
-                bk::region rid(std::string((char*)value_buf, value_size));
-
-                // scan data from bake
-                uint8_t *ptr = (uint8_t*)bcl.get_data(bph, tid, rid);
-                reader = ScanBake(stub, ptr).ValueOrDie();
+                // bake paths are yokan keys
+                session->paths = stub.paths.empty() ? std::vector<std::string>{stub.path} : stub.paths;
+                region_lookup.Refresh();
+                arrow::Status status = region_lookup.Prefetch(session->paths);
+                if (!status.ok()) {
+                    std::cerr << "Failed to prefetch regions: " << status.ToString() << std::endl;
+                }
+            } else {
+                auto paths = ResolvePaths(stub);
+                if (!paths.ok()) {
+                    session->fail(paths.status().WithMessage("Failed to resolve ", stub.path, ": ",
+                                                             paths.status().message()));
+                } else {
+                    session->paths = *paths;
+                }
+            }
+            ScanSession *s = session.get();
+            session->open = [&open, s](const std::string &path) {
+                return open(s->stub, path);
+            };
+            if (result_cache.enabled()) {
+                session->results = &result_cache;
+                session->result_id = result_id;
+            }
+            // batches that are slices of the in-memory dataset outlive the
+            // scan; so do batches served from the result cache
+            if (mode == 1) {
+                session->dataset = resident.get();
+            }
+            session->coalescer.reset(new batch_coalescer(stub.coalesce_rows, stub.coalesce_bytes, stub.coalesce_adaptive));
+            if (!stub.compression.empty()) {
+                auto codec_type = arrow::util::Codec::GetCompressionType(stub.compression);
+                if (codec_type.ok() && arrow::util::Codec::IsAvailable(*codec_type)) {
+                    session->codec = arrow::util::Codec::Create(*codec_type).ValueOrDie();
+                } else {
+                    std::cerr << "Compression " << stub.compression << " unavailable, sending uncompressed\n";
+                }
+            }
+
+            session->cq.start();
+            session->cq.set_capacity(kQueueCapacity);
+            if (stub.ordered) {
+                for (size_t i = 0; i < session->paths.size(); i++) {
+                    session->fragment_queues.emplace_back(new concurrent_queue());
+                    session->fragment_queues.back()->start();
+                    session->fragment_queues.back()->set_capacity(kQueueCapacity);
+                }
+            }
+            session->remaining = session->paths.size();
+            if (session->paths.empty()) {
+                session->cq.end();
+            }
+
+            // producers only borrow the session; removing a session joins its
+            // producers, so the pointer stays valid for as long as they run
+            size_t num_producers = std::min<size_t>(num_scan_xstreams, session->paths.size());
+            for (size_t i = 0; i < num_producers; i++) {
+                session->producers.emplace_back(new tl::managed<tl::thread>(scan_pool.make_thread([s]() {
+                    scan_handler((void*)s);
+                })));
             }
-            cq.start();
-            xstream->make_thread([&]() {
-                std::cout << "Made thread for " << stub.path.c_str() << std::endl;
-                scan_handler((void*)reader.get());
-                cq.end();
-            });
+            stats.scans.add();
+            return req.respond(session->uuid);
         };
 
-    std::function<void(const tl::request&)> clear = 
-        [](const tl::request &req) {
-            cq.clear();
+    std::function<void(const tl::request&, const std::string&)> clear = 
+        [&bc](const tl::request &req, const std::string &uuid) {
+            std::shared_ptr<ScanSession> session = st.remove(uuid);
+            if (session) {
+                session->cancel();
+            }
+            session.reset();
+            bc.sweep();
             req.respond(0);
         };
 
-    int64_t total_rows_written = 0;
-    std::function<void(const tl::request&, const bool&)> get_next_batch = 
-        [&mid, &svr_addr, &engine, &do_rdma, &total_rows_written](const tl::request &req, const bool &last) {
-            std::shared_ptr<arrow::RecordBatch> batch = nullptr;
-            if (!last) {
-                cq.pop(batch);
-            } else {
-                cq.wait_and_pop(batch);
-            }   
-
-            if (batch) {                
-                std::vector<int64_t> data_buff_sizes;
-                std::vector<int64_t> offset_buff_sizes;
-                int64_t num_rows = batch->num_rows();
-                total_rows_written += num_rows;
-
-                std::vector<std::pair<void*,std::size_t>> segments(batch->num_columns()*2);
-
-                std::string null_buff = "xx";
-
-                for (int64_t i = 0; i < batch->num_columns(); i++) {
-                    std::shared_ptr<arrow::Array> col_arr = batch->column(i);
-                    arrow::Type::type type = col_arr->type_id();
-                    int64_t null_count = col_arr->null_count();
-
-                    int64_t data_size = 0;
-                    int64_t offset_size = 0;
-
-                    if (is_binary_like(type)) {
-                        std::shared_ptr<arrow::Buffer> data_buff = 
-                            std::static_pointer_cast<arrow::BinaryArray>(col_arr)->value_data();
-                        std::shared_ptr<arrow::Buffer> offset_buff = 
-                            std::static_pointer_cast<arrow::BinaryArray>(col_arr)->value_offsets();
-                        data_size = data_buff->size();
-                        offset_size = offset_buff->size();
-                        segments[i*2].first = (void*)data_buff->data();
-                        segments[i*2].second = data_size;
-                        segments[(i*2)+1].first = (void*)offset_buff->data();
-                        segments[(i*2)+1].second = offset_size;
-                    } else {
-                        std::shared_ptr<arrow::Buffer> data_buff = 
-                            std::static_pointer_cast<arrow::PrimitiveArray>(col_arr)->values();
-                        data_size = data_buff->size();
-                        offset_size = null_buff.size() + 1; 
-                        segments[i*2].first  = (void*)data_buff->data();
-                        segments[i*2].second = data_size;
-                        segments[(i*2)+1].first = (void*)(&null_buff[0]);
-                        segments[(i*2)+1].second = offset_size;
-                    }
-
-                    data_buff_sizes.push_back(data_size);
-                    offset_buff_sizes.push_back(offset_size);
+    std::function<void(const tl::request&, const std::string&, const size_t&, const int64_t&, const uint64_t&)> get_next_batch = 
+        [&mid, &svr_addr, &engine, &do_rdma, &staging_pool, &staging_threshold, &bc](const tl::request &req, const std::string &uuid, const size_t &max_batches, const int64_t &max_bytes, const uint64_t &request_id) {
+            TRACE_SPAN("get_next_batch", request_id);
+            ScopedTimer timer(stats.get_next_batch_us);
+            std::shared_ptr<ScanSession> session = st.get(uuid);
+            if (!session) {
+                std::cerr << "Unknown scan " << uuid << std::endl;
+                return req.respond(kScanFailed);
+            }
+
+            std::vector<std::shared_ptr<PreparedBatch>> batches;
+            {
+                TRACE_SPAN("queue_wait", request_id);
+                ScopedTimer timer(stats.queue_wait_us);
+                session->next(batches, std::max<size_t>(max_batches, 1), max_bytes);
+            }
+
+            // a failed scan ends here, whatever it had queued
+            if (session->failed()) {
+                st.remove(uuid);
+                session.reset();
+                bc.sweep();
+                return req.respond(kScanFailed);
+            }
+
+            if (!batches.empty()) {
+                for (const auto &batch : batches) {
+                    stats.rows_sent.add(batch->batch->num_rows());
                 }
+                stats.batches_sent.add(batches.size());
+#ifdef ENABLE_TRACING
+                // the batches' lives before this request, on their producers' lanes
+                int64_t popped = TraceNow();
+                for (const auto &batch : batches) {
+                    const BatchTrace &t = batch->trace;
+                    Tracer::Get().RecordFor(t.tid, "scan", request_id, t.scan_begin, t.scan_end);
+                    Tracer::Get().RecordFor(t.tid, "prepare", request_id, t.scan_end, t.prepared);
+                    Tracer::Get().RecordFor(t.tid, "queued", request_id, t.prepared, popped, true);
+                }
+#endif
 
-                tl::bulk arrow_bulk = engine.expose(segments, tl::bulk_mode::read_only);
-                do_rdma.on(req.get_endpoint())(num_rows, data_buff_sizes, offset_buff_sizes, arrow_bulk);
-                return req.respond(0);
+                Transfer transfer;
+                {
+                    TRACE_SPAN("build_transfer", request_id);
+                    ScopedTimer timer(stats.build_transfer_us);
+                    BuildTransfer(engine, batches, &staging_pool, staging_threshold, 
+                                  &bc, transfer);
+                }
+                auto begin = std::chrono::steady_clock::now();
+                int received;
+                {
+                    TRACE_SPAN("do_rdma", request_id);
+                    received = do_rdma.on(req.get_endpoint())(transfer.descs, transfer.chunks, transfer.bulks);
+                }
+                auto duration = std::chrono::steady_clock::now() - begin;
+                // the client could not take the batches, so the scan cannot go on
+                if (received != kTransferOk) {
+                    std::cerr << "Scan " << uuid << ": the client failed to receive a transfer" << std::endl;
+                    st.remove(uuid);
+                    session.reset();
+                    bc.sweep();
+                    return req.respond(kScanFailed);
+                }
+                stats.do_rdma_us.record(duration);
+                stats.bytes_sent.add(transfer.size);
+                if (transfer.path == Transfer::STAGED) {
+                    stats.transfers_staged.add();
+                } else if (transfer.path == Transfer::CACHED) {
+                    stats.transfers_cached.add();
+                } else {
+                    stats.transfers_exposed.add();
+                }
+                session->coalescer->observe(transfer.size, std::chrono::duration<double>(duration).count());
+                return req.respond(kBatchesSent);
             } else {
-                std::cout << "Total rows written: " << total_rows_written << std::endl;
-                return req.respond(1);
+                st.remove(uuid);
+                session.reset();
+                bc.sweep();
+                return req.respond(kScanDone);
             }
         };
     
-    engine.define("scan", scan).disable_response();
+    engine.define("scan", scan);
     engine.define("get_next_batch", get_next_batch);
     engine.define("clear", clear);
 
-    std::cout << "Server running at address " << engine.self() << std::endl;    
+    std::function<void(const tl::request&)> get_stats = [&bc, &metadata_cache, &region_lookup, &result_cache](const tl::request &req) {
+        StatsWriter w;
+        w.add("active_scans", st.size())
+         .add("scans", stats.scans.get())
+         .add("queued_batches", stats.queued_batches.get())
+         .add("batches_sent", stats.batches_sent.get())
+         .add("rows_sent", stats.rows_sent.get())
+         .add("bytes_sent", stats.bytes_sent.get())
+         .add("transfers_staged", stats.transfers_staged.get())
+         .add("transfers_cached", stats.transfers_cached.get())
+         .add("transfers_exposed", stats.transfers_exposed.get())
+         .add("files_skipped", stats.files_skipped.get())
+         .add("row_groups_skipped", stats.row_groups_skipped.get())
+         .add("cached_registrations", bc.size())
+         .add("cached_registration_bytes", bc.bytes())
+         .add("metadata_cache_entries", metadata_cache.size())
+         .add("metadata_cache_bytes", metadata_cache.bytes())
+         .add("metadata_cache_hits", metadata_cache.hits.get())
+         .add("metadata_cache_misses", metadata_cache.misses.get())
+         .add("region_cache_entries", region_lookup.size())
+         .add("region_cache_hits", region_lookup.hits.get())
+         .add("region_cache_misses", region_lookup.misses.get())
+         .add("result_cache_entries", result_cache.size())
+         .add("result_cache_bytes", result_cache.bytes())
+         .add("result_cache_hits", result_cache.hits.get())
+         .add("result_cache_misses", result_cache.misses.get())
+         .add("get_next_batch_us", stats.get_next_batch_us)
+         .add("queue_wait_us", stats.queue_wait_us)
+         .add("build_transfer_us", stats.build_transfer_us)
+         .add("do_rdma_us", stats.do_rdma_us);
+        req.respond(w.str());
+    };
+    engine.define("stats", get_stats);
+
+#ifdef ENABLE_TRACING
+    // hands this server's spans to a client, which merges them into its trace
+    Tracer::Get().SetProcessName("ts");
+    std::function<void(const tl::request&)> trace_events = [](const tl::request &req) {
+        req.respond(Tracer::Get().Events());
+    };
+    engine.define("trace_events", trace_events);
+#endif
+
+    std::cout << "Server running at address " << engine.self() << " with " 
+              << config.progress.xstreams << " progress, " << config.rpc.xstreams << " rpc and " 
+              << config.scan.xstreams << " scan xstreams" << std::endl;    
     engine.wait_for_finalize();        
 };
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <abt.h>
+#include <thallium.hpp>
+
+
+// How many execution streams a role gets and where they run: explicit
+// `cpus` are handed out round-robin, one per xstream; a `numa_node` lets
+// every xstream float over all cores of that node. Neither means unpinned.
+struct XstreamConfig {
+    int xstreams = 0;
+    std::vector<int> cpus;
+    int numa_node = -1;
+};
+
+// The dataset mode 1 serves from memory: every file under `path`, loaded
+// once at startup. `lock` pins it with mlock, `huge_pages` asks for
+// transparent huge pages; either one copies each file into one mapping.
+struct DatasetConfig {
+    std::string path = "/mnt/cephfs/dataset";
+    bool lock = false;
+    bool huge_pages = false;
+};
+
+// The address the server listens on and its Argobots layout:
+//   progress - Mercury progress; 0 xstreams keeps it on the primary xstream
+//   rpc      - RPC handlers; 0 xstreams runs them in the progress pool
+//   scan     - scan producers, always on a pool of their own; at least 1
+//              xstream, less is raised to 1
+struct ServerConfig {
+    std::string address = "verbs://ibp130s0";
+    XstreamConfig progress;
+    XstreamConfig rpc;
+    XstreamConfig scan;
+    // budget for cached Parquet footers, 0 disables the cache
+    int64_t metadata_cache_bytes = 64 << 20;
+    // budget for cached scan results, 0 (the default) disables the cache
+    int64_t result_cache_bytes = 0;
+    // bytes of long-lived buffers kept registered for RDMA, 0 for no bound
+    int64_t registration_cache_bytes = 4LL << 30;
+    DatasetConfig dataset;
+};
+
+inline std::vector<int> CpusOfNumaNode(int node) {
+    std::vector<int> cpus;
+    std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string range;
+    // e.g. "0-7,16-23"
+    while (std::getline(fin, range, ',')) {
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+inline XstreamConfig ParseXstreamConfig(const boost::property_tree::ptree &tree, const std::string &role,
+                                        XstreamConfig defaults) {
+    auto node = tree.get_child_optional(role);
+    if (!node) {
+        return defaults;
+    }
+    XstreamConfig config = defaults;
+    config.xstreams = node->get<int>("xstreams", defaults.xstreams);
+    config.numa_node = node->get<int>("numa_node", defaults.numa_node);
+    auto cpus = node->get_child_optional("cpus");
+    if (cpus) {
+        config.cpus.clear();
+        for (const auto &cpu : *cpus) {
+            config.cpus.push_back(cpu.second.get_value<int>());
+        }
+    }
+    return config;
+}
+
+// Reads the config from a JSON file such as thallium_config.json; a missing
+// file gives the defaults: the verbs address, a dedicated progress xstream,
+// handlers in the progress pool, and `num_scan_xstreams` scan xstreams,
+// none of them pinned.
+inline ServerConfig LoadServerConfig(const std::string &path, int num_scan_xstreams) {
+    ServerConfig config;
+    config.progress.xstreams = 1;
+    config.scan.xstreams = num_scan_xstreams;
+
+    std::ifstream fin(path);
+    if (fin) {
+        boost::property_tree::ptree tree;
+        boost::property_tree::read_json(fin, tree);
+        config.address = tree.get<std::string>("address", config.address);
+        config.progress = ParseXstreamConfig(tree, "progress", config.progress);
+        config.rpc = ParseXstreamConfig(tree, "rpc", config.rpc);
+        config.scan = ParseXstreamConfig(tree, "scan", config.scan);
+        config.metadata_cache_bytes = tree.get<int64_t>("metadata_cache_bytes", config.metadata_cache_bytes);
+        config.result_cache_bytes = tree.get<int64_t>("result_cache_bytes", config.result_cache_bytes);
+        config.registration_cache_bytes = tree.get<int64_t>("registration_cache_bytes",
+                                                            config.registration_cache_bytes);
+        config.dataset.path = tree.get<std::string>("dataset.path", config.dataset.path);
+        config.dataset.lock = tree.get<bool>("dataset.lock", config.dataset.lock);
+        config.dataset.huge_pages = tree.get<bool>("dataset.huge_pages", config.dataset.huge_pages);
+    }
+    // without a scan xstream no producer would ever run
+    if (config.scan.xstreams < 1) {
+        std::cerr << "scan.xstreams is " << config.scan.xstreams << ", using 1\n";
+        config.scan.xstreams = 1;
+    }
+    return config;
+}
+
+// Creates the xstreams of a role on `pool`, pinned as configured.
+inline void CreateXstreams(const XstreamConfig &config, const thallium::pool &pool,
+                           std::vector<thallium::managed<thallium::xstream>> &xstreams) {
+    std::vector<int> node_cpus;
+    if (config.numa_node >= 0) {
+        node_cpus = CpusOfNumaNode(config.numa_node);
+    }
+    for (int i = 0; i < config.xstreams; i++) {
+        xstreams.push_back(thallium::xstream::create(thallium::scheduler::predef::deflt, pool));
+        ABT_xstream handle = xstreams.back()->native_handle();
+        if (!config.cpus.empty()) {
+            int cpu = config.cpus[i % config.cpus.size()];
+            ABT_xstream_set_affinity(handle, 1, &cpu);
+        } else if (!node_cpus.empty()) {
+            ABT_xstream_set_affinity(handle, node_cpus.size(), node_cpus.data());
+        }
+    }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <arrow/memory_pool.h>
+#include <arrow/status.h>
+
+#include <thallium.hpp>
+
+
+// First-fit allocator over the offsets of a fixed-size region. Freed ranges
+// are merged with their neighbours so the region does not fragment over time.
+class SlabAllocator {
+    private:
+        std::map<int64_t, int64_t> free_list;
+        int64_t capacity;
+        int64_t alignment;
+        int64_t allocated = 0;
+        mutable std::mutex m;
+
+    public:
+        SlabAllocator(int64_t capacity, int64_t alignment)
+            : capacity(capacity), alignment(alignment) {
+            free_list[0] = capacity;
+        }
+
+        // returns the offset of the allocation, or -1 if nothing fits
+        int64_t Allocate(int64_t size) {
+            size = (size + alignment - 1) / alignment * alignment;
+            std::lock_guard<std::mutex> lock(m);
+            for (auto it = free_list.begin(); it != free_list.end(); ++it) {
+                if (it->second < size) {
+                    continue;
+                }
+                int64_t offset = it->first;
+                int64_t remaining = it->second - size;
+                free_list.erase(it);
+                if (remaining > 0) {
+                    free_list[offset + size] = remaining;
+                }
+                allocated += size;
+                return offset;
+            }
+            return -1;
+        }
+
+        void Free(int64_t offset, int64_t size) {
+            size = (size + alignment - 1) / alignment * alignment;
+            std::lock_guard<std::mutex> lock(m);
+            allocated -= size;
+            auto it = free_list.emplace(offset, size).first;
+            auto next = std::next(it);
+            if (next != free_list.end() && it->first + it->second == next->first) {
+                it->second += next->second;
+                free_list.erase(next);
+            }
+            if (it != free_list.begin()) {
+                auto prev = std::prev(it);
+                if (prev->first + prev->second == it->first) {
+                    prev->second += it->second;
+                    free_list.erase(it);
+                }
+            }
+        }
+
+        int64_t bytes_allocated() const {
+            std::lock_guard<std::mutex> lock(m);
+            return allocated;
+        }
+};
+
+
+// An arrow::MemoryPool carved out of one slab that is exposed to thallium
+// once, at construction. Allocations that do not fit fall back to the
+// default pool; callers check Contains() to know whether the memory is
+// covered by bulk().
+class SlabMemoryPool : public arrow::MemoryPool {
+    public:
+        SlabMemoryPool(thallium::engine &engine, int64_t capacity, thallium::bulk_mode mode)
+            : allocator(capacity, 64), capacity(capacity) {
+            if (posix_memalign((void**)&base, 64, capacity) != 0) {
+                throw std::bad_alloc();
+            }
+            std::vector<std::pair<void*,std::size_t>> segments(1);
+            segments[0].first = (void*)base;
+            segments[0].second = capacity;
+            slab_bulk = engine.expose(segments, mode);
+        }
+
+        ~SlabMemoryPool() override {
+            slab_bulk = thallium::bulk();
+            free(base);
+        }
+
+        arrow::Status Allocate(int64_t size, uint8_t** out) override {
+            int64_t offset = size > 0 ? allocator.Allocate(size) : -1;
+            if (offset < 0) {
+                return fallback->Allocate(size, out);
+            }
+            *out = base + offset;
+            return arrow::Status::OK();
+        }
+
+        arrow::Status Reallocate(int64_t old_size, int64_t new_size, uint8_t** ptr) override {
+            if (!Contains(*ptr)) {
+                return fallback->Reallocate(old_size, new_size, ptr);
+            }
+            uint8_t *out;
+            RETURN_NOT_OK(Allocate(new_size, &out));
+            memcpy(out, *ptr, std::min(old_size, new_size));
+            Free(*ptr, old_size);
+            *ptr = out;
+            return arrow::Status::OK();
+        }
+
+        void Free(uint8_t* buffer, int64_t size) override {
+            if (!Contains(buffer)) {
+                return fallback->Free(buffer, size);
+            }
+            allocator.Free(buffer - base, size);
+        }
+
+        int64_t bytes_allocated() const override {
+            return allocator.bytes_allocated();
+        }
+
+        std::string backend_name() const override { return "slab"; }
+
+        bool Contains(const uint8_t* ptr) const {
+            return ptr >= base && ptr < base + capacity;
+        }
+
+        int64_t Offset(const uint8_t* ptr) const { return ptr - base; }
+
+        thallium::bulk& bulk() { return slab_bulk; }
+
+        // deregisters the slab, e.g. before the engine is finalized
+        void release() { slab_bulk = thallium::bulk(); }
+
+    private:
+        SlabAllocator allocator;
+        arrow::MemoryPool *fallback = arrow::default_memory_pool();
+        uint8_t *base = nullptr;
+        int64_t capacity;
+        thallium::bulk slab_bulk;
+};
@@ -0,0 +1,38 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+
+#include <thallium.hpp>
+
+#include "payload.h"
+
+namespace tl = thallium;
+
+
+// Polls the `stats` RPC of a running ts and prints one JSON object per line.
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cout << "./tstat <port|address> [interval_ms] [count]\n";
+        exit(0);
+    }
+
+    std::string uri = ServerUri(argv[1]);
+    int interval_ms = argc > 2 ? atoi(argv[2]) : 1000;
+    // 0 polls until interrupted
+    int count = argc > 3 ? atoi(argv[3]) : 0;
+
+    tl::engine engine(ListenAddress(uri), THALLIUM_CLIENT_MODE);
+    tl::remote_procedure stats = engine.define("stats");
+    tl::endpoint endpoint = engine.lookup(uri);
+
+    for (int i = 0; count == 0 || i < count; i++) {
+        if (i > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+        }
+        std::string s = stats.on(endpoint)();
+        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::cout << "{\"time_ms\": " << now << ", \"stats\": " << s << "}" << std::endl;
+    }
+    engine.finalize();
+}
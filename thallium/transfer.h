@@ -0,0 +1,320 @@
+#pragma once
+
+#include <unordered_map>
+
+#include <arrow/api.h>
+#include <arrow/array/concatenate.h>
+#include <arrow/util/checked_cast.h>
+#include <arrow/util/compression.h>
+#include <arrow/util/parallel.h>
+
+#include <thallium.hpp>
+
+#include "payload.h"
+#include "bulk_cache.h"
+
+
+inline int64_t BatchSize(const std::shared_ptr<arrow::RecordBatch> &batch) {
+    int64_t size = 0;
+    for (int64_t i = 0; i < batch->num_columns(); i++) {
+        for (const auto &buff : batch->column_data(i)->buffers) {
+            if (buff) {
+                size += buff->size();
+            }
+        }
+    }
+    return size;
+}
+
+static uint8_t padding[kTransferAlignment] = {0};
+
+inline bool IsTransferable(const arrow::DataType &type) {
+    if (type.id() == arrow::Type::DICTIONARY) {
+        const auto &dict_type = arrow::internal::checked_cast<const arrow::DictionaryType&>(type);
+        return IsTransferable(*dict_type.value_type());
+    }
+    return arrow::is_fixed_width(type.id()) || arrow::is_binary_like(type.id()) ||
+           arrow::is_large_binary_like(type.id());
+}
+
+inline int64_t BytesForBits(int64_t bits) { return (bits + 7) / 8; }
+
+inline std::shared_ptr<arrow::Buffer> Trim(const std::shared_ptr<arrow::Buffer> &buff, int64_t size) {
+    if (buff == nullptr || buff->size() <= size) {
+        return buff;
+    }
+    return arrow::SliceBuffer(buff, 0, size);
+}
+
+// Returns `data` with offset 0 and every buffer cut to what its `length`
+// elements use, so the buffers can be sent as they are. Slices of fixed-width
+// arrays without nulls are re-pointed; any other slice is copied.
+inline arrow::Result<std::shared_ptr<arrow::ArrayData>> Normalize(const std::shared_ptr<arrow::ArrayData> &data) {
+    const arrow::DataType &type = *data->type;
+    std::shared_ptr<arrow::ArrayData> out = data;
+
+    if (data->offset != 0) {
+        if (data->GetNullCount() == 0 && arrow::is_fixed_width(type.id()) && 
+            type.id() != arrow::Type::BOOL && type.id() != arrow::Type::DICTIONARY) {
+            int64_t width = arrow::internal::checked_cast<const arrow::FixedWidthType&>(type).bit_width() / 8;
+            out = data->Copy();
+            out->buffers[0] = nullptr;
+            out->buffers[1] = arrow::SliceBuffer(data->buffers[1], data->offset * width, data->length * width);
+            out->offset = 0;
+        } else {
+            ARROW_ASSIGN_OR_RAISE(auto arr, arrow::Concatenate({arrow::MakeArray(data)}));
+            out = arr->data();
+        }
+    } else {
+        out = data->Copy();
+    }
+
+    int64_t length = out->length;
+    out->buffers[0] = Trim(out->buffers[0], BytesForBits(length));
+    if (out->buffers[1] == nullptr) {
+        // nothing to cut, e.g. an empty dictionary
+    } else if (arrow::is_binary_like(type.id())) {
+        const int32_t *offsets = out->GetValues<int32_t>(1, 0);
+        out->buffers[1] = Trim(out->buffers[1], (length + 1) * sizeof(int32_t));
+        out->buffers[2] = Trim(out->buffers[2], offsets[length]);
+    } else if (arrow::is_large_binary_like(type.id())) {
+        const int64_t *offsets = out->GetValues<int64_t>(1, 0);
+        out->buffers[1] = Trim(out->buffers[1], (length + 1) * sizeof(int64_t));
+        out->buffers[2] = Trim(out->buffers[2], offsets[length]);
+    } else {
+        const auto &fw_type = type.id() == arrow::Type::DICTIONARY ?
+            *arrow::internal::checked_cast<const arrow::DictionaryType&>(type).index_type() : type;
+        int64_t bit_width = arrow::internal::checked_cast<const arrow::FixedWidthType&>(fw_type).bit_width();
+        out->buffers[1] = Trim(out->buffers[1], BytesForBits(length * bit_width));
+    }
+
+    if (data->dictionary != nullptr) {
+        ARROW_ASSIGN_OR_RAISE(out->dictionary, Normalize(data->dictionary));
+    }
+    return out;
+}
+
+// buffers smaller than this are not worth a codec call
+const int64_t kMinCompressSize = 4096;
+// a compressed buffer is only sent if it is at most this fraction of the original
+const double kMaxCompressRatio = 0.9;
+
+// A column (or dictionary) ready to be sent: normalized, plus a compressed
+// copy of every buffer that compressed well, nullptr for the others.
+struct PreparedArray {
+    std::shared_ptr<arrow::ArrayData> data;
+    std::vector<std::shared_ptr<arrow::Buffer>> compressed;
+};
+
+// A batch as it sits in a session's queue. Normalizing and compressing
+// happen on the producer side, so get_next_batch only lays out buffers.
+// When a batch was scanned and prepared and by which thread, in tracing
+// builds; recorded as spans once a get_next_batch ships the batch.
+struct BatchTrace {
+    int64_t scan_begin = 0;
+    int64_t scan_end = 0;
+    int64_t prepared = 0;
+    int tid = 0;
+};
+
+struct PreparedBatch {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    std::vector<PreparedArray> columns;
+    // one per column, `data` is nullptr unless the column is dictionary-encoded
+    std::vector<PreparedArray> dictionaries;
+    arrow::Compression::type codec = arrow::Compression::UNCOMPRESSED;
+    int64_t wire_size = 0;
+    // the batch's buffers outlive the scan (a resident dataset, the result
+    // cache), so their registrations are worth keeping
+    bool resident = false;
+    BatchTrace trace;
+};
+
+// Whether buffer `i` of `data` goes on the wire at all: no validity bitmap
+// is sent for an array without nulls.
+inline bool IsSent(const std::shared_ptr<arrow::ArrayData> &data, size_t i) {
+    return data->buffers[i] != nullptr && !(i == 0 && data->GetNullCount() == 0);
+}
+
+inline arrow::Result<std::shared_ptr<PreparedBatch>> PrepareBatch(const std::shared_ptr<arrow::RecordBatch> &batch,
+                                                                  arrow::util::Codec *codec) {
+    auto prepared = std::make_shared<PreparedBatch>();
+    prepared->batch = batch;
+    prepared->columns.resize(batch->num_columns());
+    prepared->dictionaries.resize(batch->num_columns());
+    if (codec != nullptr) {
+        prepared->codec = codec->compression_type();
+    }
+
+    std::vector<std::pair<PreparedArray*, size_t>> sent;
+    auto collect = [&sent](PreparedArray &array) {
+        array.compressed.resize(array.data->buffers.size());
+        for (size_t j = 0; j < array.data->buffers.size(); j++) {
+            if (IsSent(array.data, j)) {
+                sent.emplace_back(&array, j);
+            }
+        }
+    };
+
+    for (int64_t i = 0; i < batch->num_columns(); i++) {
+        const std::shared_ptr<arrow::ArrayData> &col_data = batch->column_data(i);
+        if (!IsTransferable(*col_data->type)) {
+            return arrow::Status::NotImplemented("Cannot transfer column ", batch->schema()->field(i)->name(),
+                                                 " of type ", col_data->type->ToString());
+        }
+        ARROW_ASSIGN_OR_RAISE(prepared->columns[i].data, Normalize(col_data));
+        collect(prepared->columns[i]);
+        if (prepared->columns[i].data->dictionary != nullptr) {
+            prepared->dictionaries[i].data = prepared->columns[i].data->dictionary;
+            collect(prepared->dictionaries[i]);
+        }
+    }
+
+    if (codec != nullptr) {
+        // one task per buffer, on Arrow's CPU pool
+        RETURN_NOT_OK(arrow::internal::ParallelFor(static_cast<int>(sent.size()), [&](int k) -> arrow::Status {
+            PreparedArray *array = sent[k].first;
+            const std::shared_ptr<arrow::Buffer> &buff = array->data->buffers[sent[k].second];
+            if (buff->size() < kMinCompressSize) {
+                return arrow::Status::OK();
+            }
+            int64_t max_len = codec->MaxCompressedLen(buff->size(), buff->data());
+            ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::ResizableBuffer> out, arrow::AllocateResizableBuffer(max_len));
+            ARROW_ASSIGN_OR_RAISE(int64_t len, codec->Compress(buff->size(), buff->data(), max_len, out->mutable_data()));
+            if (len <= buff->size() * kMaxCompressRatio) {
+                RETURN_NOT_OK(out->Resize(len));
+                array->compressed[sent[k].second] = out;
+            }
+            return arrow::Status::OK();
+        }));
+    }
+
+    for (const auto &s : sent) {
+        const std::shared_ptr<arrow::Buffer> &compressed = s.first->compressed[s.second];
+        prepared->wire_size += compressed ? compressed->size() : s.first->data->buffers[s.second]->size();
+    }
+    return prepared;
+}
+
+// One buffer of a transfer and the offset it lands at on the receiver.
+// Compressed copies are transient and never go through the bulk cache.
+struct TransferPiece {
+    std::shared_ptr<arrow::Buffer> buff;
+    int64_t offset;
+    bool cacheable;
+};
+
+inline void LayoutArray(const PreparedArray &array, ArrayDesc &desc,
+                        std::vector<TransferPiece> &pieces, int64_t &offset) {
+    const std::shared_ptr<arrow::ArrayData> &data = array.data;
+    desc.length = data->length;
+    desc.null_count = data->GetNullCount();
+    desc.offset = data->offset;
+    for (size_t i = 0; i < data->buffers.size(); i++) {
+        if (!IsSent(data, i)) {
+            desc.buffer_sizes.push_back(-1);
+            desc.compressed_sizes.push_back(-1);
+            continue;
+        }
+        const std::shared_ptr<arrow::Buffer> &compressed = array.compressed[i];
+        const std::shared_ptr<arrow::Buffer> &buff = compressed ? compressed : data->buffers[i];
+        desc.buffer_sizes.push_back(data->buffers[i]->size());
+        desc.compressed_sizes.push_back(compressed ? compressed->size() : -1);
+        if (buff->size() > 0) {
+            pieces.push_back({buff, offset, compressed == nullptr});
+            offset += PaddedSize(buff->size());
+        }
+    }
+}
+
+// Lays out the buffers of a batch starting at `offset`, each one padded to
+// kTransferAlignment, and returns the offset past the last one.
+inline int64_t LayoutBatch(const PreparedBatch &batch, BatchDesc &desc,
+                           std::vector<TransferPiece> &pieces, int64_t offset) {
+    desc.num_rows = batch.batch->num_rows();
+    desc.codec = static_cast<int32_t>(batch.codec);
+    desc.columns.resize(batch.columns.size());
+    desc.dictionaries.resize(batch.columns.size());
+    for (size_t i = 0; i < batch.columns.size(); i++) {
+        LayoutArray(batch.columns[i], desc.columns[i], pieces, offset);
+        if (batch.dictionaries[i].data != nullptr) {
+            LayoutArray(batch.dictionaries[i], desc.dictionaries[i], pieces, offset);
+        }
+    }
+    return offset;
+}
+
+// Everything a do_rdma call carries, plus whatever has to stay alive on the
+// server until the client has pulled it.
+struct Transfer {
+    std::vector<BatchDesc> descs;
+    std::vector<TransferChunk> chunks;
+    std::vector<thallium::bulk> bulks;
+    std::shared_ptr<arrow::Buffer> staging;
+    int64_t size = 0;
+    // how the data was made available for the pull
+    enum Path { STAGED, CACHED, EXPOSED } path = EXPOSED;
+};
+
+// Describes `batches` as a transfer. Small transfers are copied into the
+// pre-registered staging slab; transfers of resident batches only are sent
+// from the registrations cached in `cache`; anything else is exposed for
+// this transfer only.
+inline void BuildTransfer(thallium::engine &engine,
+                          const std::vector<std::shared_ptr<PreparedBatch>> &batches,
+                          SlabMemoryPool *staging_pool, int64_t staging_threshold,
+                          bulk_cache *cache, Transfer &transfer) {
+    std::vector<TransferPiece> pieces;
+    transfer.descs.resize(batches.size());
+    bool cacheable = true;
+    for (size_t i = 0; i < batches.size(); i++) {
+        transfer.size = LayoutBatch(*batches[i], transfer.descs[i], pieces, transfer.size);
+        cacheable = cacheable && batches[i]->resident;
+    }
+    for (const auto &piece : pieces) {
+        cacheable = cacheable && piece.cacheable;
+    }
+
+    if (staging_pool != nullptr && transfer.size <= staging_threshold) {
+        std::shared_ptr<arrow::Buffer> staging = 
+            arrow::AllocateBuffer(transfer.size, staging_pool).ValueOrDie();
+        if (staging_pool->Contains(staging->data())) {
+            uint8_t *base = const_cast<uint8_t*>(staging->data());
+            for (const auto &piece : pieces) {
+                memcpy(base + piece.offset, piece.buff->data(), piece.buff->size());
+            }
+            transfer.staging = staging;
+            transfer.path = Transfer::STAGED;
+            transfer.bulks.push_back(staging_pool->bulk());
+            transfer.chunks.push_back({0, staging_pool->Offset(base), 0, transfer.size});
+            return;
+        }
+    }
+
+    if (cache != nullptr && cacheable) {
+        transfer.path = Transfer::CACHED;
+        std::unordered_map<const uint8_t*, int32_t> bulk_index;
+        for (const auto &piece : pieces) {
+            std::shared_ptr<arrow::Buffer> root = RootOf(piece.buff);
+            auto it = bulk_index.find(root->data());
+            if (it == bulk_index.end()) {
+                it = bulk_index.emplace(root->data(), (int32_t)transfer.bulks.size()).first;
+                transfer.bulks.push_back(cache->get(root));
+            }
+            transfer.chunks.push_back({it->second, piece.buff->data() - root->data(),
+                                       piece.offset, piece.buff->size()});
+        }
+        return;
+    }
+
+    std::vector<std::pair<void*,std::size_t>> segments;
+    for (const auto &piece : pieces) {
+        int64_t size = piece.buff->size();
+        segments.emplace_back((void*)piece.buff->data(), size);
+        if (PaddedSize(size) > size) {
+            segments.emplace_back((void*)padding, PaddedSize(size) - size);
+        }
+    }
+    transfer.bulks.push_back(engine.expose(segments, thallium::bulk_mode::read_only));
+    transfer.chunks.push_back({0, 0, 0, transfer.size});
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <fcntl.h>
+#include <liburing.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arrow/buffer.h>
+#include <arrow/io/interfaces.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/util/future.h>
+
+
+// O_DIRECT reads need offsets, sizes and buffers aligned to the device's
+// logical block size
+const int64_t kDirectAlignment = 4096;
+
+// One io_uring shared by every UringFile of the process. Reads are submitted
+// under a lock from any thread; a reaper thread waits for completions and
+// fulfills the future of each read.
+class UringContext {
+    private:
+        struct PendingRead {
+            arrow::Future<std::shared_ptr<arrow::Buffer>> future;
+            std::shared_ptr<arrow::Buffer> buffer;
+            // where the read landed in `buffer`, and where the caller's
+            // bytes start within the read
+            int64_t align;
+            int64_t lead;
+            int64_t nbytes;
+            // keeps the file, and so its descriptor, open until completion
+            std::shared_ptr<void> owner;
+        };
+
+        static const unsigned kEntries = 256;
+
+        io_uring ring;
+        arrow::Status init_status;
+        std::mutex submit_mutex;
+        std::thread reaper;
+
+        // with submit_mutex held; flushes the submission queue when it is full
+        io_uring_sqe* GetSqe() {
+            io_uring_sqe *sqe;
+            while ((sqe = io_uring_get_sqe(&ring)) == nullptr) {
+                io_uring_submit(&ring);
+            }
+            return sqe;
+        }
+
+        void Reap() {
+            while (true) {
+                io_uring_cqe *cqe;
+                int ret = io_uring_wait_cqe(&ring, &cqe);
+                if (ret == -EINTR) {
+                    continue;
+                }
+                if (ret < 0) {
+                    break;
+                }
+                void *data = io_uring_cqe_get_data(cqe);
+                int res = cqe->res;
+                io_uring_cqe_seen(&ring, cqe);
+                if (data == this) {
+                    break;
+                }
+                if (data == nullptr) {
+                    // read-ahead advice, nobody waits for it
+                    continue;
+                }
+                PendingRead *read = static_cast<PendingRead*>(data);
+                if (res < 0) {
+                    read->future.MarkFinished(arrow::Status::IOError("io_uring read: ", strerror(-res)));
+                } else {
+                    int64_t available = std::max<int64_t>(0, res - read->lead);
+                    read->future.MarkFinished(arrow::SliceBuffer(
+                        read->buffer, read->align + read->lead, std::min(read->nbytes, available)));
+                }
+                delete read;
+            }
+        }
+
+        UringContext() {
+            int ret = io_uring_queue_init(kEntries, &ring, 0);
+            if (ret < 0) {
+                init_status = arrow::Status::IOError("io_uring_queue_init: ", strerror(-ret));
+                return;
+            }
+            reaper = std::thread([this]() { Reap(); });
+        }
+
+    public:
+        static UringContext& Get() {
+            static UringContext context;
+            return context;
+        }
+
+        ~UringContext() {
+            if (!init_status.ok()) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(submit_mutex);
+                io_uring_sqe *sqe = GetSqe();
+                io_uring_prep_nop(sqe);
+                io_uring_sqe_set_data(sqe, this);
+                io_uring_submit(&ring);
+            }
+            reaper.join();
+            io_uring_queue_exit(&ring);
+        }
+
+        // Reads [position, position + nbytes) of fd. With `direct`, the read
+        // is widened to aligned bounds and the result sliced back down.
+        arrow::Future<std::shared_ptr<arrow::Buffer>> Read(int fd, int64_t position, int64_t nbytes,
+                                                           bool direct, std::shared_ptr<void> owner) {
+            if (!init_status.ok()) {
+                return arrow::Future<std::shared_ptr<arrow::Buffer>>::MakeFinished(init_status);
+            }
+            int64_t begin = position;
+            int64_t end = position + nbytes;
+            int64_t padding = 0;
+            if (direct) {
+                begin = begin / kDirectAlignment * kDirectAlignment;
+                end = (end + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment;
+                padding = kDirectAlignment;
+            }
+            auto buffer = arrow::AllocateBuffer(end - begin + padding);
+            if (!buffer.ok()) {
+                return arrow::Future<std::shared_ptr<arrow::Buffer>>::MakeFinished(buffer.status());
+            }
+            std::shared_ptr<arrow::Buffer> data = std::move(*buffer);
+            int64_t align = 0;
+            if (direct) {
+                align = (kDirectAlignment - (int64_t)((uintptr_t)data->data() % kDirectAlignment)) % kDirectAlignment;
+            }
+
+            auto *read = new PendingRead{arrow::Future<std::shared_ptr<arrow::Buffer>>::Make(),
+                                         data, align, position - begin, nbytes, std::move(owner)};
+            auto future = read->future;
+            std::lock_guard<std::mutex> lock(submit_mutex);
+            io_uring_sqe *sqe = GetSqe();
+            io_uring_prep_read(sqe, fd, data->mutable_data() + align, (unsigned)(end - begin), begin);
+            io_uring_sqe_set_data(sqe, read);
+            io_uring_submit(&ring);
+            return future;
+        }
+
+        // asks the kernel to start reading a range into the page cache
+        void Advise(int fd, int64_t position, int64_t nbytes) {
+            if (!init_status.ok()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(submit_mutex);
+            io_uring_sqe *sqe = GetSqe();
+            io_uring_prep_fadvise(sqe, fd, position, (off_t)nbytes, POSIX_FADV_WILLNEED);
+            io_uring_sqe_set_data(sqe, nullptr);
+            io_uring_submit(&ring);
+        }
+};
+
+// A local file read through io_uring. ReadAsync submits one read and returns
+// without blocking, so Parquet's pre-buffering keeps many column chunk reads
+// in flight at once; the synchronous reads wait on the same path.
+class UringFile : public arrow::io::RandomAccessFile {
+    private:
+        int fd;
+        int64_t size;
+        bool direct;
+        int64_t pos = 0;
+        bool is_closed = false;
+
+        UringFile(int fd, int64_t size, bool direct) : fd(fd), size(size), direct(direct) {}
+
+        arrow::Status CheckOpen() const {
+            if (is_closed) {
+                return arrow::Status::Invalid("Operation on closed file");
+            }
+            return arrow::Status::OK();
+        }
+
+    public:
+        using arrow::io::RandomAccessFile::ReadAsync;
+
+        // with `direct`, reads bypass the page cache (O_DIRECT)
+        static arrow::Result<std::shared_ptr<UringFile>> Open(const std::string &path, bool direct) {
+            int fd = open(path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+            if (fd < 0) {
+                return arrow::Status::IOError("Cannot open ", path, ": ", strerror(errno));
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                return arrow::Status::IOError("Cannot stat ", path, ": ", strerror(errno));
+            }
+            return std::shared_ptr<UringFile>(new UringFile(fd, st.st_size, direct));
+        }
+
+        ~UringFile() override {
+            if (!is_closed) {
+                close(fd);
+            }
+        }
+
+        arrow::Future<std::shared_ptr<arrow::Buffer>> ReadAsync(const arrow::io::IOContext&,
+                                                                int64_t position, int64_t nbytes) override {
+            arrow::Status st = CheckOpen();
+            if (st.ok() && (position < 0 || position > size)) {
+                st = arrow::Status::IOError("Read at ", position, " outside file of ", size, " bytes");
+            }
+            if (!st.ok()) {
+                return arrow::Future<std::shared_ptr<arrow::Buffer>>::MakeFinished(st);
+            }
+            nbytes = std::max<int64_t>(0, std::min(nbytes, size - position));
+            return UringContext::Get().Read(fd, position, nbytes, direct, shared_from_this());
+        }
+
+        arrow::Status WillNeed(const std::vector<arrow::io::ReadRange>& ranges) override {
+            RETURN_NOT_OK(CheckOpen());
+            // the page cache is bypassed with O_DIRECT, there is nothing to warm
+            if (!direct) {
+                for (const auto &range : ranges) {
+                    UringContext::Get().Advise(fd, range.offset, range.length);
+                }
+            }
+            return arrow::Status::OK();
+        }
+
+        arrow::Result<std::shared_ptr<arrow::Buffer>> ReadAt(int64_t position, int64_t nbytes) override {
+            return ReadAsync(arrow::io::default_io_context(), position, nbytes).result();
+        }
+
+        arrow::Result<int64_t> ReadAt(int64_t position, int64_t nbytes, void* out) override {
+            ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(position, nbytes));
+            memcpy(out, buffer->data(), buffer->size());
+            return buffer->size();
+        }
+
+        arrow::Result<int64_t> Read(int64_t nbytes, void* out) override {
+            ARROW_ASSIGN_OR_RAISE(int64_t bytes_read, ReadAt(pos, nbytes, out));
+            pos += bytes_read;
+            return bytes_read;
+        }
+
+        arrow::Result<std::shared_ptr<arrow::Buffer>> Read(int64_t nbytes) override {
+            ARROW_ASSIGN_OR_RAISE(auto buffer, ReadAt(pos, nbytes));
+            pos += buffer->size();
+            return buffer;
+        }
+
+        arrow::Result<int64_t> GetSize() override {
+            RETURN_NOT_OK(CheckOpen());
+            return size;
+        }
+
+        arrow::Status Seek(int64_t position) override {
+            RETURN_NOT_OK(CheckOpen());
+            if (position < 0 || position > size) {
+                return arrow::Status::IOError("Seek to ", position, " outside file of ", size, " bytes");
+            }
+            pos = position;
+            return arrow::Status::OK();
+        }
+
+        arrow::Result<int64_t> Tell() const override {
+            RETURN_NOT_OK(CheckOpen());
+            return pos;
+        }
+
+        arrow::Status Close() override {
+            if (!is_closed) {
+                is_closed = true;
+                close(fd);
+            }
+            return arrow::Status::OK();
+        }
+
+        bool closed() const override { return is_closed; }
+};